@@ -41,6 +41,8 @@ THE SOFTWARE.
 
 #include "babeld.h"
 #include "util.h"
+#include "timer.h"
+#include "event.h"
 #include "net.h"
 #include "kernel.h"
 #include "interface.h"
@@ -73,8 +75,11 @@ const char *logfile = NULL,
     *pidfile = "/var/run/babeld.pid",
     *state_file = "/var/lib/babel-state";
 
+/* RECEIVE_BATCH consecutive buffers of receive_buffer_size bytes. */
 unsigned char *receive_buffer = NULL;
 int receive_buffer_size = 0;
+/* receive_batches[n] counts the reads that returned n datagrams. */
+static unsigned long receive_batches[RECEIVE_BATCH + 1];
 
 const unsigned char zeroes[16] = {0};
 const unsigned char ones[16] =
@@ -88,20 +93,33 @@ int kernel_socket = -1;
 static int kernel_routes_changed = 0;
 static int kernel_link_changed = 0;
 static int kernel_addr_changed = 0;
+static int local_server_listening = 0;
+static int protocol_socket_writing = 0;
 
 struct timeval check_neighbours_timeout, check_interfaces_timeout;
 
 static volatile sig_atomic_t exiting = 0, dumping = 0, reopening = 0;
 
 static int accept_local_connections(void);
+static void receive_packets(void);
+static void flush_send_queue(void);
 static void init_signals(void);
 static void dump_tables(FILE *out);
 
 static int
 kernel_route_notify(struct kernel_route *route, void *closure)
 {
-    kernel_routes_changed = 1;
-    return -1;
+    int rc;
+
+    if(kernel_routes_changed)
+        return -1;
+
+    rc = apply_kernel_route(route);
+    if(rc < 0) {
+        kernel_routes_changed = 1;
+        return -1;
+    }
+    return 0;
 }
 
 static int
@@ -127,7 +145,6 @@ kernel_link_notify(struct kernel_link *link, void *closure)
 int
 main(int argc, char **argv)
 {
-    struct sockaddr_in6 sin6;
     int rc, fd, i, opt;
     time_t expiry_time, source_expiry_time, kernel_dump_time;
     const char **config_files = NULL;
@@ -279,7 +296,8 @@ main(int argc, char **argv)
             config_files[num_config_files++] = optarg;
             break;
         case 'C':
-            rc = parse_config_from_string(optarg, strlen(optarg), NULL);
+            rc = parse_config_from_string(optarg, strlen(optarg),
+                                          NULL, NULL);
             if(rc != CONFIG_ACTION_DONE) {
                 fprintf(stderr,
                         "Couldn't parse configuration from command line.\n");
@@ -409,6 +427,13 @@ main(int argc, char **argv)
         goto fail_pid;
     }
 
+    rc = event_setup(1);
+    if(rc < 0) {
+        fprintf(stderr, "event_setup failed.\n");
+        kernel_setup(0);
+        goto fail_pid;
+    }
+
     rc = kernel_setup_socket(1);
     if(rc < 0) {
         fprintf(stderr, "kernel_setup_socket failed.\n");
@@ -503,6 +528,9 @@ main(int argc, char **argv)
         perror("Couldn't create link local socket");
         goto fail;
     }
+    rc = event_add(protocol_socket, EVENT_READ);
+    if(rc < 0)
+        goto fail;
 
     if(local_server_port >= 0) {
         local_server_socket = tcp_server_socket(local_server_port, 1);
@@ -552,6 +580,7 @@ main(int argc, char **argv)
         send_wildcard_retraction(ifp);
         flushupdates(ifp);
         flushbuf(&ifp->buf, ifp);
+        flush_send_queue();
     }
 
     FOR_ALL_INTERFACES(ifp) {
@@ -565,14 +594,13 @@ main(int argc, char **argv)
         send_multicast_request(ifp, NULL, 0, NULL, 0);
         flushupdates(ifp);
         flushbuf(&ifp->buf, ifp);
+        flush_send_queue();
     }
 
     debugf("Entering main loop.\n");
 
     while(1) {
         struct timeval tv;
-        fd_set readfds;
-        struct neighbour *neigh;
 
         gettime(&now);
 
@@ -581,46 +609,31 @@ main(int argc, char **argv)
         timeval_min_sec(&tv, expiry_time);
         timeval_min_sec(&tv, source_expiry_time);
         timeval_min_sec(&tv, kernel_dump_time);
-        timeval_min(&tv, &resend_time);
-        FOR_ALL_INTERFACES(ifp) {
-            if(!if_up(ifp))
-                continue;
-            timeval_min(&tv, &ifp->buf.timeout);
-            timeval_min(&tv, &ifp->hello_timeout);
-            timeval_min(&tv, &ifp->update_timeout);
-            timeval_min(&tv, &ifp->update_flush_timeout);
-        }
-        FOR_ALL_NEIGHBOURS(neigh) {
-            timeval_min(&tv, &neigh->buf.timeout);
-        }
-        FD_ZERO(&readfds);
+        timer_min(&tv);
         if(timeval_compare(&tv, &now) > 0) {
-            int maxfd = 0;
             timeval_minus(&tv, &tv, &now);
-            FD_SET(protocol_socket, &readfds);
-            maxfd = MAX(maxfd, protocol_socket);
-            if(kernel_socket < 0) kernel_setup_socket(1);
-            if(kernel_socket >= 0) {
-                FD_SET(kernel_socket, &readfds);
-                maxfd = MAX(maxfd, kernel_socket);
-            }
-            if(local_server_socket >= 0 &&
-               num_local_sockets < MAX_LOCAL_SOCKETS) {
-                FD_SET(local_server_socket, &readfds);
-                maxfd = MAX(maxfd, local_server_socket);
-            }
-            for(i = 0; i < num_local_sockets; i++) {
-                FD_SET(local_sockets[i].fd, &readfds);
-                maxfd = MAX(maxfd, local_sockets[i].fd);
-            }
-            rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
-            if(rc < 0) {
-                if(errno != EINTR) {
-                    perror("select");
-                    sleep(1);
-                }
-                rc = 0;
-                FD_ZERO(&readfds);
+        } else {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+        }
+
+        if(kernel_socket < 0) kernel_setup_socket(1);
+        /* Stop accepting connections while the socket table is full. */
+        if(local_server_socket >= 0 &&
+           local_server_listening !=
+           (num_local_sockets < MAX_LOCAL_SOCKETS)) {
+            local_server_listening = !local_server_listening;
+            if(local_server_listening)
+                event_add(local_server_socket, EVENT_READ);
+            else
+                event_del(local_server_socket);
+        }
+
+        rc = event_wait(&tv);
+        if(rc < 0) {
+            if(errno != EINTR) {
+                perror("event_wait");
+                sleep(1);
             }
         }
 
@@ -629,7 +642,7 @@ main(int argc, char **argv)
         if(exiting)
             break;
 
-        if(kernel_socket >= 0 && FD_ISSET(kernel_socket, &readfds)) {
+        if(kernel_socket >= 0 && event_ready(kernel_socket)) {
             struct kernel_filter filter = {0};
             filter.route = kernel_route_notify;
             filter.addr = kernel_addr_notify;
@@ -637,37 +650,19 @@ main(int argc, char **argv)
             kernel_callback(&filter);
         }
 
-        if(FD_ISSET(protocol_socket, &readfds)) {
-            rc = babel_recv(protocol_socket,
-                            receive_buffer, receive_buffer_size,
-                            (struct sockaddr*)&sin6, sizeof(sin6));
-            if(rc < 0) {
-                if(errno != EAGAIN && errno != EINTR) {
-                    perror("recv");
-                    sleep(1);
-                }
-            } else {
-                FOR_ALL_INTERFACES(ifp) {
-                    if(!if_up(ifp))
-                        continue;
-                    if(ifp->ifindex == sin6.sin6_scope_id) {
-                        parse_packet((unsigned char*)&sin6.sin6_addr, ifp,
-                                     receive_buffer, rc);
-                        VALGRIND_MAKE_MEM_UNDEFINED(receive_buffer,
-                                                    receive_buffer_size);
-                        break;
-                    }
-                }
-            }
-        }
+        if(event_ready(protocol_socket) & EVENT_READ)
+            receive_packets();
 
-        if(local_server_socket >= 0 && FD_ISSET(local_server_socket, &readfds))
+        if(local_server_socket >= 0 && event_ready(local_server_socket))
            accept_local_connections();
 
         i = 0;
         while(i < num_local_sockets) {
-            if(FD_ISSET(local_sockets[i].fd, &readfds)) {
-                rc = local_read(&local_sockets[i]);
+            int ready = event_ready(local_sockets[i]->fd);
+            if(ready & EVENT_WRITE)
+                local_flush(local_sockets[i]);
+            if(ready & EVENT_READ) {
+                rc = local_read(local_sockets[i]);
                 if(rc <= 0) {
                     if(rc < 0) {
                         if(errno == EINTR || errno == EAGAIN)
@@ -733,40 +728,10 @@ main(int argc, char **argv)
             source_expiry_time = now.tv_sec + roughly(300);
         }
 
-        FOR_ALL_INTERFACES(ifp) {
-            if(!if_up(ifp))
-                continue;
-            if(timeval_compare(&now, &ifp->hello_timeout) >= 0)
-                send_hello(ifp);
-            if(timeval_compare(&now, &ifp->update_timeout) >= 0)
-                send_update(ifp, 0, NULL, 0, NULL, 0);
-            if(timeval_compare(&now, &ifp->update_flush_timeout) >= 0)
-                flushupdates(ifp);
-        }
-
-        if(resend_time.tv_sec != 0) {
-            if(timeval_compare(&now, &resend_time) >= 0)
-                do_resend();
-        }
+        run_timers();
 
-        FOR_ALL_INTERFACES(ifp) {
-            if(!if_up(ifp))
-                continue;
-            if(ifp->buf.timeout.tv_sec != 0) {
-                if(timeval_compare(&now, &ifp->buf.timeout) >= 0) {
-                    flushupdates(ifp);
-                    flushbuf(&ifp->buf, ifp);
-                }
-            }
-        }
-
-        FOR_ALL_NEIGHBOURS(neigh) {
-            if(neigh->buf.timeout.tv_sec != 0) {
-                if(timeval_compare(&now, &neigh->buf.timeout) >= 0) {
-                    flushbuf(&neigh->buf, neigh->ifp);
-                }
-            }
-        }
+        kernel_route_sync();
+        flush_send_queue();
 
         if(UNLIKELY(debug || dumping)) {
             dump_tables(stdout);
@@ -789,6 +754,7 @@ main(int argc, char **argv)
            association caches. */
         send_multicast_hello(ifp, 10, 1);
         flushbuf(&ifp->buf, ifp);
+        flush_send_queue();
         usleep(roughly(1000));
         gettime(&now);
     }
@@ -799,12 +765,14 @@ main(int argc, char **argv)
         send_wildcard_retraction(ifp);
         send_multicast_hello(ifp, 1, 1);
         flushbuf(&ifp->buf, ifp);
+        flush_send_queue();
         usleep(roughly(10000));
         gettime(&now);
         interface_updown(ifp, 0);
     }
     kernel_setup_socket(0);
     kernel_setup(0);
+    event_setup(0);
 
     fd = open(state_file, O_WRONLY | O_TRUNC | O_CREAT, 0644);
     if(fd < 0) {
@@ -867,6 +835,61 @@ main(int argc, char **argv)
     exit(1);
 }
 
+static void
+receive_packets()
+{
+    struct sockaddr_in6 sin6[RECEIVE_BATCH];
+    int lens[RECEIVE_BATCH];
+    struct interface *ifp;
+    int i, n;
+
+    n = babel_recv_batch(protocol_socket,
+                         receive_buffer, receive_buffer_size, RECEIVE_BATCH,
+                         sin6, lens);
+    if(n < 0) {
+        if(errno != EAGAIN && errno != EINTR) {
+            perror("recv");
+            sleep(1);
+        }
+        return;
+    }
+
+    receive_batches[n]++;
+
+    /* One timestamp for the whole batch, for the RTT computation. */
+    gettime(&now);
+
+    for(i = 0; i < n; i++) {
+        unsigned char *buf = receive_buffer + i * receive_buffer_size;
+        FOR_ALL_INTERFACES(ifp) {
+            if(!if_up(ifp))
+                continue;
+            if(ifp->ifindex == sin6[i].sin6_scope_id) {
+                parse_packet((unsigned char*)&sin6[i].sin6_addr, ifp,
+                             buf, lens[i]);
+                VALGRIND_MAKE_MEM_UNDEFINED(buf, receive_buffer_size);
+                break;
+            }
+        }
+    }
+
+    select_dirty_routes();
+}
+
+/* Sends the datagrams queued by flushbuf.  If the socket is full, we
+   wait for it to become writable rather than spinning. */
+static void
+flush_send_queue()
+{
+    int pending = babel_flush_queue(protocol_socket);
+
+    if((pending > 0) != protocol_socket_writing) {
+        protocol_socket_writing = (pending > 0);
+        event_add(protocol_socket,
+                  EVENT_READ | (protocol_socket_writing ? EVENT_WRITE : 0));
+    }
+}
+
 static int
 accept_local_connections()
 {
@@ -887,7 +910,7 @@ accept_local_connections()
     }
 
     if(num_local_sockets >= MAX_LOCAL_SOCKETS) {
-        /* This should never happen, since we don't select for
+        /* This should never happen, since we don't wait for
            the server socket in this case.  But I'm paranoid. */
         fprintf(stderr, "Internal error: too many local sockets.\n");
         close(s);
@@ -914,6 +937,12 @@ accept_local_connections()
         close(s);
         return -1;
     }
+    rc = event_add(s, EVENT_READ);
+    if(rc < 0) {
+        fprintf(stderr, "Unable to register local socket.\n");
+        local_socket_destroy(num_local_sockets - 1);
+        return -1;
+    }
     local_header(ls);
     return 1;
 }
@@ -950,7 +979,7 @@ resize_receive_buffer(int size)
     if(size <= receive_buffer_size)
         return 0;
 
-    new = realloc(receive_buffer, size);
+    new = realloc(receive_buffer, size * RECEIVE_BATCH);
     if(new == NULL) {
         perror("realloc(receive_buffer)");
         return -1;
@@ -1082,6 +1111,7 @@ dump_xroute(FILE *out, struct xroute *xroute)
 static void
 dump_tables(FILE *out)
 {
+    int i;
     struct neighbour *neigh;
     struct xroute_stream *xroutes;
     struct route_stream *routes;
@@ -1125,6 +1155,18 @@ dump_tables(FILE *out)
         route_stream_done(routes);
     }
 
+    fprintf(out, "Receive batches:");
+    for(i = 1; i <= RECEIVE_BATCH; i++) {
+        if(receive_batches[i] > 0)
+            fprintf(out, " %d:%lu", i, receive_batches[i]);
+    }
+    fprintf(out, "\n");
+    if(send_queue_drops > 0)
+        fprintf(out, "Send queue drops: %lu\n", send_queue_drops);
+    if(updates_sent > 0)
+        fprintf(out, "Updates sent: %lu (%.1f bytes per route)\n",
+                updates_sent, (double)update_bytes_sent / updates_sent);
+
     fflush(out);
 }
 
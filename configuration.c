@@ -27,6 +27,7 @@ THE SOFTWARE.
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <assert.h>
+#include <strings.h>
 
 #ifdef __linux
 /* Defining it rather than including <linux/rtnetlink.h> because this
@@ -36,15 +37,66 @@ THE SOFTWARE.
 
 #include "babeld.h"
 #include "util.h"
+#include "timer.h"
 #include "interface.h"
 #include "route.h"
 #include "kernel.h"
+#include "xroute.h"
 #include "configuration.h"
 
-static struct filter *input_filters = NULL;
-static struct filter *output_filters = NULL;
-static struct filter *redistribute_filters = NULL;
-static struct filter *install_filters = NULL;
+/* A filter list is compiled into a binary trie indexed by destination
+   prefix, with chains of nodes that hold no rules collapsed.  Each node
+   that ends the prefix of some rule holds the set of rules whose prefix
+   covers that node, as a bitset indexed by rule number.  Lookup takes
+   the set of the deepest such node on the path of the route, restricts
+   it by prefix length and address family, and checks the remaining
+   candidates in order until one matches. */
+
+struct filter_node {
+    struct filter_node *child[2];
+    unsigned char prefix[16];
+    unsigned char plen;
+    unsigned int *rules;
+};
+
+struct compiled_filter {
+    int numrules, words;
+    struct filter **rules;
+    struct filter_node *root;
+    unsigned int *by_plen;      /* 129 sets of words words */
+    unsigned int *not_v4;       /* rules that cannot match IPv4 */
+};
+
+struct filter_list {
+    struct filter *filters;
+    struct compiled_filter *compiled;
+    int compile_failed;         /* don't retry until the filters change */
+};
+
+static struct filter_list input_filters, output_filters;
+static struct filter_list redistribute_filters, install_filters;
+
+/* Results of output_filter, keyed by router-id, prefix and interface.
+   Only valid for the filter generation they were computed in; the
+   generation is bumped whenever the filters or interface numbering
+   change. */
+
+struct output_cache_entry {
+    unsigned char id[8];
+    unsigned char prefix[16];
+    unsigned char src_prefix[16];
+    unsigned char plen, src_plen;
+    unsigned int ifindex;
+    unsigned int generation;
+    int add_metric;
+};
+
+#define OUTPUT_CACHE_MAX (1 << 22)
+#define OUTPUT_CACHE_PROBES 8
+
+static struct output_cache_entry *output_cache;
+static int output_cache_size = 0, output_cache_count = 0;
+static unsigned int filter_generation = 1;
 struct interface_conf *default_interface_conf = NULL;
 static struct interface_conf *interface_confs = NULL;
 
@@ -693,20 +745,34 @@ parse_ifconf(int c, gnc_t gnc, void *closure,
     return -2;
 }
 
+static void flush_compiled_filter(struct filter_list *list);
+
+/* Entries from an earlier generation count as free slots. */
+static void
+bump_filter_generation(void)
+{
+    filter_generation++;
+    if(filter_generation == 0)
+        filter_generation = 1;
+    output_cache_count = 0;
+}
+
 static void
-add_filter(struct filter *filter, struct filter **filters)
+add_filter(struct filter *filter, struct filter_list *list)
 {
-    if(*filters == NULL) {
+    if(list->filters == NULL) {
         filter->next = NULL;
-        *filters = filter;
+        list->filters = filter;
     } else {
         struct filter *f;
-        f = *filters;
+        f = list->filters;
         while(f->next)
             f = f->next;
         filter->next = NULL;
         f->next = filter;
     }
+    flush_compiled_filter(list);
+    bump_filter_generation();
 }
 
 static void
@@ -958,13 +1024,16 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
 
 static int
 parse_config_line(int c, gnc_t gnc, void *closure,
-                  int *action_return, const char **message_return)
+                  int *action_return, const char **message_return,
+                  int *interval_return)
 {
     char *token = NULL;
     if(action_return)
         *action_return = CONFIG_ACTION_DONE;
     if(message_return)
         *message_return = NULL;
+    if(interval_return)
+        *interval_return = 0;
 
     c = skip_whitespace(c, gnc, closure);
     if(c < 0 || c == '\n' || c == '#')
@@ -987,16 +1056,41 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         if(c < -1 || !action_return)
             goto fail;
         *action_return = CONFIG_ACTION_DUMP;
-    } else if(strcmp(token, "monitor") == 0) {
+    } else if(strcmp(token, "dump-clients") == 0) {
         c = skip_eol(c, gnc, closure);
         if(c < -1 || !action_return)
             goto fail;
+        *action_return = CONFIG_ACTION_DUMP_CLIENTS;
+    } else if(strcmp(token, "monitor") == 0) {
+        int interval = 0;
+        c = skip_whitespace(c, gnc, closure);
+        if(c >= 0 && c != '\n' && c != '#') {
+            char *token2 = NULL;
+            c = getword(c, &token2, gnc, closure);
+            if(c < -1 || strcmp(token2, "coalesce") != 0) {
+                free(token2);
+                goto fail;
+            }
+            free(token2);
+            c = getthousands(c, &interval, gnc, closure);
+            if(c < -1 || interval <= 0 || interval > 3600000)
+                goto fail;
+        }
+        c = skip_eol(c, gnc, closure);
+        if(c < -1 || !action_return || !interval_return)
+            goto fail;
         *action_return = CONFIG_ACTION_MONITOR;
+        *interval_return = interval;
     } else if(strcmp(token, "unmonitor") == 0) {
         c = skip_eol(c, gnc, closure);
         if(c < -1 || !action_return)
             goto fail;
         *action_return = CONFIG_ACTION_UNMONITOR;
+    } else if(strcmp(token, "binary") == 0) {
+        c = skip_eol(c, gnc, closure);
+        if(c < -1 || !action_return)
+            goto fail;
+        *action_return = CONFIG_ACTION_BINARY;
     } else if(config_finalised && !local_server_write) {
         /* The remaining directives are only allowed in read-write mode. */
         c = skip_to_eol(c, gnc, closure);
@@ -1139,7 +1233,7 @@ parse_config_from_file(const char *filename, int *line_return)
         return 0;
 
     while(1) {
-        c = parse_config_line(c, (gnc_t)gnc_file, &s, NULL, NULL);
+        c = parse_config_line(c, (gnc_t)gnc_file, &s, NULL, NULL, NULL);
         if(c < -1) {
             *line_return = s.line;
             return -1;
@@ -1167,7 +1261,8 @@ gnc_buf(struct buf_state *s)
 }
 
 int
-parse_config_from_string(char *string, int n, const char **message_return)
+parse_config_from_string(char *string, int n, const char **message_return,
+                         int *interval_return)
 {
     int c, action;
     const char *message;
@@ -1177,7 +1272,8 @@ parse_config_from_string(char *string, int n, const char **message_return)
     if(c < 0)
         return -1;
 
-    c = parse_config_line(c, (gnc_t)gnc_buf, &s, &action, &message);
+    c = parse_config_line(c, (gnc_t)gnc_buf, &s, &action, &message,
+                          interval_return);
     if(c == -1) {
         if(message_return)
             *message_return = message;
@@ -1199,10 +1295,11 @@ renumber_filter(struct filter *filter)
 void
 renumber_filters()
 {
-    renumber_filter(input_filters);
-    renumber_filter(output_filters);
-    renumber_filter(redistribute_filters);
-    renumber_filter(install_filters);
+    renumber_filter(input_filters.filters);
+    renumber_filter(output_filters.filters);
+    renumber_filter(redistribute_filters.filters);
+    renumber_filter(install_filters.filters);
+    bump_filter_generation();
 }
 
 static int
@@ -1271,27 +1368,254 @@ filter_match(struct filter *f, const unsigned char *id,
     return 1;
 }
 
+static void
+flush_filter_node(struct filter_node *node)
+{
+    if(node == NULL)
+        return;
+    flush_filter_node(node->child[0]);
+    flush_filter_node(node->child[1]);
+    free(node->rules);
+    free(node);
+}
+
+static void
+flush_compiled_filter(struct filter_list *list)
+{
+    struct compiled_filter *cf = list->compiled;
+
+    list->compile_failed = 0;
+    if(cf == NULL)
+        return;
+    flush_filter_node(cf->root);
+    free(cf->rules);
+    free(cf->by_plen);
+    free(cf->not_v4);
+    free(cf);
+    list->compiled = NULL;
+}
+
+#define SET_RULE(set, i) ((set)[(i) / 32] |= 1U << ((i) % 32))
+
+/* Returns the node for prefix/plen, creating it and its ancestors. */
+static struct filter_node *
+filter_node(struct compiled_filter *cf,
+            const unsigned char *prefix, unsigned char plen)
+{
+    struct filter_node *node = cf->root;
+    int i;
+
+    for(i = 0; i < plen; i++) {
+        int b = (prefix[i / 8] >> (7 - i % 8)) & 1;
+        if(node->child[b] == NULL) {
+            node->child[b] = calloc(1, sizeof(struct filter_node));
+            if(node->child[b] == NULL)
+                return NULL;
+            normalize_prefix(node->child[b]->prefix, prefix, i + 1);
+            node->child[b]->plen = i + 1;
+        }
+        node = node->child[b];
+    }
+    return node;
+}
+
+/* Give every terminal node the rules of its terminal ancestors. */
+static void
+inherit_filter_rules(struct compiled_filter *cf, struct filter_node *node,
+                     const unsigned int *inherited)
+{
+    int i;
+
+    if(node->rules) {
+        if(inherited)
+            for(i = 0; i < cf->words; i++)
+                node->rules[i] |= inherited[i];
+        inherited = node->rules;
+    }
+    for(i = 0; i < 2; i++)
+        if(node->child[i])
+            inherit_filter_rules(cf, node->child[i], inherited);
+}
+
+/* Replace nodes that hold no rules and have a single child by that
+   child. */
+static void
+collapse_filter_node(struct filter_node **nodep)
+{
+    struct filter_node *node = *nodep;
+    int i;
+
+    for(i = 0; i < 2; i++)
+        if(node->child[i])
+            collapse_filter_node(&node->child[i]);
+
+    if(node->rules == NULL &&
+       (node->child[0] == NULL) != (node->child[1] == NULL)) {
+        *nodep = node->child[0] ? node->child[0] : node->child[1];
+        free(node);
+    }
+}
+
+static struct compiled_filter *
+compile_filter(struct filter *filters)
+{
+    static const unsigned char v4root[16] =
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0};
+    struct compiled_filter *cf;
+    struct filter *f;
+    int i, p;
+
+    cf = calloc(1, sizeof(struct compiled_filter));
+    if(cf == NULL)
+        return NULL;
+
+    for(f = filters; f; f = f->next)
+        cf->numrules++;
+    cf->words = (cf->numrules + 31) / 32;
+
+    cf->rules = calloc(cf->numrules, sizeof(struct filter*));
+    cf->root = calloc(1, sizeof(struct filter_node));
+    cf->by_plen = calloc(129 * cf->words, sizeof(unsigned int));
+    cf->not_v4 = calloc(cf->words, sizeof(unsigned int));
+    if(cf->rules == NULL || cf->root == NULL ||
+       cf->by_plen == NULL || cf->not_v4 == NULL)
+        goto fail;
+
+    for(i = 0, f = filters; f; i++, f = f->next) {
+        struct filter_node *node;
+        cf->rules[i] = f;
+        if(f->prefix)
+            node = filter_node(cf, f->prefix, f->plen);
+        else if(f->af == AF_INET)
+            node = filter_node(cf, v4root, 96);
+        else
+            node = cf->root;
+        if(node == NULL)
+            goto fail;
+        if(node->rules == NULL) {
+            node->rules = calloc(cf->words, sizeof(unsigned int));
+            if(node->rules == NULL)
+                goto fail;
+        }
+        SET_RULE(node->rules, i);
+        for(p = f->plen_ge; p <= f->plen_le && p <= 128; p++)
+            SET_RULE(cf->by_plen + p * cf->words, i);
+        if(f->af == AF_INET6)
+            SET_RULE(cf->not_v4, i);
+    }
+
+    inherit_filter_rules(cf, cf->root, NULL);
+    for(i = 0; i < 2; i++)
+        if(cf->root->child[i])
+            collapse_filter_node(&cf->root->child[i]);
+    return cf;
+
+ fail:
+    flush_filter_node(cf->root);
+    free(cf->rules);
+    free(cf->by_plen);
+    free(cf->not_v4);
+    free(cf);
+    return NULL;
+}
+
+static void
+compile_filters(void)
+{
+    struct filter_list *lists[4] =
+        { &input_filters, &output_filters,
+          &redistribute_filters, &install_filters };
+    int i;
+
+    for(i = 0; i < 4; i++) {
+        if(lists[i]->filters && !lists[i]->compiled &&
+           !lists[i]->compile_failed) {
+            lists[i]->compiled = compile_filter(lists[i]->filters);
+            if(lists[i]->compiled == NULL) {
+                fprintf(stderr, "Couldn't compile filters.\n");
+                lists[i]->compile_failed = 1;
+            }
+        }
+    }
+}
+
+/* Returns the first rule that matches, or NULL. */
+static struct filter *
+compiled_match(struct compiled_filter *cf, const unsigned char *id,
+               const unsigned char *prefix, unsigned short plen,
+               const unsigned char *src_prefix, unsigned short src_plen,
+               const unsigned char *neigh, unsigned int ifindex, int proto)
+{
+    struct filter_node *node = cf->root;
+    const unsigned int *rules = node->rules, *by_plen;
+    int w, v4;
+
+    if(plen > 128)
+        return NULL;
+
+    while(node->plen < plen) {
+        int i = node->plen;
+        node = node->child[(prefix[i / 8] >> (7 - i % 8)) & 1];
+        if(node == NULL || node->plen > plen ||
+           !in_prefix(prefix, node->prefix, node->plen))
+            break;
+        if(node->rules)
+            rules = node->rules;
+    }
+    if(rules == NULL)
+        return NULL;
+
+    by_plen = cf->by_plen + plen * cf->words;
+    v4 = plen >= 96 && v4mapped(prefix);
+    for(w = 0; w < cf->words; w++) {
+        unsigned int set = rules[w] & by_plen[w];
+        if(v4)
+            set &= ~cf->not_v4[w];
+        while(set) {
+            int b = ffs(set) - 1;
+            struct filter *f = cf->rules[w * 32 + b];
+            if(filter_match(f, id, prefix, plen, src_prefix, src_plen,
+                            neigh, ifindex, proto))
+                return f;
+            set &= ~(1U << b);
+        }
+    }
+    return NULL;
+}
+
 static int
-do_filter(struct filter *f, const unsigned char *id,
+do_filter(struct filter_list *list, const unsigned char *id,
           const unsigned char *prefix, unsigned short plen,
           const unsigned char *src_prefix, unsigned short src_plen,
           const unsigned char *neigh, unsigned int ifindex, int proto,
           struct filter_result *result)
 {
+    struct filter *f;
+
     if(result)
         memset(result, 0, sizeof(struct filter_result));
 
-    while(f) {
-        if(filter_match(f, id, prefix, plen, src_prefix, src_plen,
-                        neigh, ifindex, proto)) {
-            if(result)
-                memcpy(result, &f->action, sizeof(struct filter_result));
-            return f->action.add_metric;
+    if(list->filters && !list->compiled && !list->compile_failed)
+        compile_filters();
+
+    if(list->compiled && prefix) {
+        f = compiled_match(list->compiled, id, prefix, plen,
+                           src_prefix, src_plen, neigh, ifindex, proto);
+    } else {
+        f = list->filters;
+        while(f) {
+            if(filter_match(f, id, prefix, plen, src_prefix, src_plen,
+                            neigh, ifindex, proto))
+                break;
+            f = f->next;
         }
-        f = f->next;
     }
 
-    return -1;
+    if(f == NULL)
+        return -1;
+    if(result)
+        memcpy(result, &f->action, sizeof(struct filter_result));
+    return f->action.add_metric;
 }
 
 int
@@ -1301,24 +1625,160 @@ input_filter(const unsigned char *id,
              const unsigned char *neigh, unsigned int ifindex)
 {
     int res;
-    res = do_filter(input_filters, id, prefix, plen,
+    res = do_filter(&input_filters, id, prefix, plen,
                     src_prefix, src_plen, neigh, ifindex, 0, NULL);
     if(res < 0)
         res = 0;
     return res;
 }
 
+static unsigned int
+output_cache_hash(const unsigned char *id,
+                  const unsigned char *prefix, unsigned char plen,
+                  const unsigned char *src_prefix, unsigned char src_plen,
+                  unsigned int ifindex)
+{
+    unsigned int h = HASH_INIT;
+    h = hash_bytes(h, id, 8);
+    h = hash_bytes(h, prefix, 16);
+    h = hash_bytes(h, &plen, 1);
+    h = hash_bytes(h, src_prefix, 16);
+    h = hash_bytes(h, &src_plen, 1);
+    h = hash_bytes(h, &ifindex, sizeof(ifindex));
+    return h;
+}
+
+/* Returns the slot for the given key, or NULL if the cache is not
+   allocated.  *found is set if the slot holds that key; otherwise the
+   slot is either free or, if all OUTPUT_CACHE_PROBES slots are taken,
+   a live entry that may be evicted. */
+static struct output_cache_entry *
+output_cache_slot(const unsigned char *id,
+                  const unsigned char *prefix, unsigned char plen,
+                  const unsigned char *src_prefix, unsigned char src_plen,
+                  unsigned int ifindex, int *found)
+{
+    struct output_cache_entry *e;
+    unsigned int i, h;
+
+    *found = 0;
+    if(output_cache == NULL)
+        return NULL;
+
+    h = output_cache_hash(id, prefix, plen, src_prefix, src_plen, ifindex);
+    for(i = 0; i < OUTPUT_CACHE_PROBES; i++) {
+        e = &output_cache[(h + i) & (output_cache_size - 1)];
+        if(e->generation != filter_generation)
+            return e;
+        if(e->ifindex == ifindex && e->plen == plen &&
+           e->src_plen == src_plen &&
+           memcmp(e->prefix, prefix, 16) == 0 &&
+           memcmp(e->src_prefix, src_prefix, 16) == 0 &&
+           memcmp(e->id, id, 8) == 0) {
+            *found = 1;
+            return e;
+        }
+    }
+    return &output_cache[h & (output_cache_size - 1)];
+}
+
+/* The cache holds about one entry per route and interface; beyond that,
+   entries are evicted in place rather than growing the table. */
+static int
+output_cache_limit(void)
+{
+    struct interface *ifp;
+    long n = 0, limit = 256;
+
+    FOR_ALL_INTERFACES(ifp)
+        n++;
+    n *= installed_routes_estimate() + xroutes_estimate();
+    while(limit < 2 * n && limit < OUTPUT_CACHE_MAX)
+        limit *= 2;
+    return limit;
+}
+
+/* Grow the table if it is getting full and still under its limit. */
+static int
+output_cache_reserve(void)
+{
+    struct output_cache_entry *old = output_cache, *e;
+    int i, old_size = output_cache_size, size, found;
+
+    if(output_cache != NULL && output_cache_count < output_cache_size / 2)
+        return 0;
+
+    size = output_cache_size < 1 ? 256 : output_cache_size * 2;
+    if(size > output_cache_limit())
+        return output_cache != NULL ? 0 : -1;
+
+    output_cache = calloc(size, sizeof(struct output_cache_entry));
+    if(output_cache == NULL) {
+        output_cache = old;
+        return old != NULL ? 0 : -1;
+    }
+    output_cache_size = size;
+    output_cache_count = 0;
+
+    for(i = 0; i < old_size; i++) {
+        if(old[i].generation != filter_generation)
+            continue;
+        e = output_cache_slot(old[i].id, old[i].prefix, old[i].plen,
+                              old[i].src_prefix, old[i].src_plen,
+                              old[i].ifindex, &found);
+        if(e->generation != filter_generation)
+            output_cache_count++;
+        *e = old[i];
+    }
+    free(old);
+    return 1;
+}
+
 int
 output_filter(const unsigned char *id,
               const unsigned char *prefix, unsigned short plen,
               const unsigned char *src_prefix, unsigned short src_plen,
               unsigned int ifindex)
 {
-    int res;
-    res = do_filter(output_filters, id, prefix, plen,
+    struct output_cache_entry *e = NULL;
+    int res, cacheable, found = 0;
+
+    /* Hashing the key costs more than an empty filter list. */
+    if(output_filters.filters == NULL)
+        return 0;
+
+    cacheable = id && prefix && src_prefix;
+
+    if(cacheable) {
+        e = output_cache_slot(id, prefix, plen, src_prefix, src_plen,
+                              ifindex, &found);
+        if(found)
+            return e->add_metric;
+    }
+
+    res = do_filter(&output_filters, id, prefix, plen,
                     src_prefix, src_plen, NULL, ifindex, 0, NULL);
     if(res < 0)
         res = 0;
+
+    if(cacheable) {
+        int rc = output_cache_reserve();
+        if(rc > 0)
+            e = output_cache_slot(id, prefix, plen, src_prefix, src_plen,
+                                  ifindex, &found);
+        if(rc >= 0 && e != NULL) {
+            if(e->generation != filter_generation)
+                output_cache_count++;
+            memcpy(e->id, id, 8);
+            memcpy(e->prefix, prefix, 16);
+            e->plen = plen;
+            memcpy(e->src_prefix, src_prefix, 16);
+            e->src_plen = src_plen;
+            e->ifindex = ifindex;
+            e->generation = filter_generation;
+            e->add_metric = res;
+        }
+    }
     return res;
 }
 
@@ -1329,7 +1789,7 @@ redistribute_filter(const unsigned char *prefix, unsigned short plen,
                     struct filter_result *result)
 {
     int res;
-    res = do_filter(redistribute_filters, NULL, prefix, plen,
+    res = do_filter(&redistribute_filters, NULL, prefix, plen,
                     src_prefix, src_plen, NULL, ifindex, proto, result);
     if(res < 0)
         res = INFINITY;
@@ -1343,7 +1803,7 @@ install_filter(const unsigned char *prefix, unsigned short plen,
                struct filter_result *result)
 {
     int res;
-    res = do_filter(install_filters, NULL, prefix, plen,
+    res = do_filter(&install_filters, NULL, prefix, plen,
                     src_prefix, src_plen, NULL, ifindex, 0, result);
     if(res < 0)
         res = INFINITY;
@@ -1361,6 +1821,7 @@ finalise_config()
     filter->plen_le = 128;
     filter->src_plen_le = 128;
     add_filter(filter, &redistribute_filters);
+    compile_filters();
 
     while(interface_confs) {
         struct interface_conf *if_conf;
@@ -28,6 +28,8 @@ THE SOFTWARE.
 #define CONFIG_ACTION_MONITOR 3
 #define CONFIG_ACTION_UNMONITOR 4
 #define CONFIG_ACTION_NO 5
+#define CONFIG_ACTION_BINARY 6
+#define CONFIG_ACTION_DUMP_CLIENTS 7
 
 struct filter_result {
     unsigned int add_metric; /* allow = 0, deny = INF, metric = <0..INF> */
@@ -59,7 +61,8 @@ extern struct interface_conf *default_interface_conf;
 void flush_ifconf(struct interface_conf *if_conf);
 
 int parse_config_from_file(const char *filename, int *line_return);
-int parse_config_from_string(char *string, int n, const char **message_return);
+int parse_config_from_string(char *string, int n, const char **message_return,
+                             int *interval_return);
 void renumber_filters(void);
 
 int input_filter(const unsigned char *id,
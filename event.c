@@ -0,0 +1,253 @@
+/*
+Copyright (c) 2026 by the babeld contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#if defined(__linux) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include "babeld.h"
+#include "util.h"
+#include "event.h"
+
+#ifdef USE_EPOLL
+
+#define MAX_EVENTS 64
+
+static int epoll_fd = -1;
+static struct epoll_event events[MAX_EVENTS];
+static int num_events = 0;
+
+/* Readiness of the descriptors returned by the last call to event_wait,
+   indexed by descriptor, so that event_ready is constant time. */
+static unsigned char *ready = NULL;
+static int ready_size = 0;
+
+static int
+event_mask(int events)
+{
+    return ((events & EVENT_READ) ? EPOLLIN : 0) |
+        ((events & EVENT_WRITE) ? EPOLLOUT : 0);
+}
+
+int
+event_setup(int setup)
+{
+    if(setup) {
+        if(epoll_fd >= 0)
+            return 1;
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(epoll_fd < 0) {
+            perror("epoll_create");
+            return -1;
+        }
+        return 1;
+    } else {
+        if(epoll_fd >= 0)
+            close(epoll_fd);
+        epoll_fd = -1;
+        free(ready);
+        ready = NULL;
+        ready_size = 0;
+        num_events = 0;
+        return 1;
+    }
+}
+
+/* Registers fd, or changes the events we wait for if it is already
+   registered. */
+int
+event_add(int fd, int events)
+{
+    struct epoll_event ev;
+    int rc;
+
+    if(epoll_fd < 0 || fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(fd >= ready_size) {
+        int n = MAX(fd + 1, 2 * ready_size);
+        unsigned char *new_ready = realloc(ready, n);
+        if(new_ready == NULL)
+            return -1;
+        memset(new_ready + ready_size, 0, n - ready_size);
+        ready = new_ready;
+        ready_size = n;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = event_mask(events);
+    ev.data.fd = fd;
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    if(rc < 0 && errno == EEXIST)
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    if(rc < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 1;
+}
+
+/* Must be called before fd is closed.  Unknown descriptors are
+   silently ignored. */
+void
+event_del(int fd)
+{
+    int i;
+
+    if(epoll_fd < 0 || fd < 0)
+        return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    if(fd < ready_size)
+        ready[fd] = 0;
+    /* Don't report events for a descriptor that may get reused. */
+    for(i = 0; i < num_events; i++) {
+        if(events[i].data.fd == fd)
+            events[i].data.fd = -1;
+    }
+}
+
+int
+event_wait(const struct timeval *tv)
+{
+    int i, rc, timeout;
+
+    for(i = 0; i < num_events; i++) {
+        if(events[i].data.fd >= 0)
+            ready[events[i].data.fd] = 0;
+    }
+    num_events = 0;
+
+    timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+    rc = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if(rc < 0)
+        return -1;
+
+    num_events = rc;
+    for(i = 0; i < num_events; i++) {
+        int fd = events[i].data.fd;
+        if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ready[fd] |= EVENT_READ;
+        if(events[i].events & (EPOLLOUT | EPOLLERR))
+            ready[fd] |= EVENT_WRITE;
+    }
+    return rc;
+}
+
+int
+event_ready(int fd)
+{
+    if(fd < 0 || fd >= ready_size)
+        return 0;
+    return ready[fd];
+}
+
+#else
+
+static fd_set read_fds, write_fds;
+static fd_set ready_read_fds, ready_write_fds;
+static int maxfd = -1;
+
+int
+event_setup(int setup)
+{
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_ZERO(&ready_read_fds);
+    FD_ZERO(&ready_write_fds);
+    maxfd = -1;
+    return 1;
+}
+
+int
+event_add(int fd, int events)
+{
+    if(fd < 0 || fd >= FD_SETSIZE) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(events & EVENT_READ)
+        FD_SET(fd, &read_fds);
+    else
+        FD_CLR(fd, &read_fds);
+    if(events & EVENT_WRITE)
+        FD_SET(fd, &write_fds);
+    else
+        FD_CLR(fd, &write_fds);
+    maxfd = MAX(maxfd, fd);
+    return 1;
+}
+
+void
+event_del(int fd)
+{
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return;
+
+    FD_CLR(fd, &read_fds);
+    FD_CLR(fd, &write_fds);
+    FD_CLR(fd, &ready_read_fds);
+    FD_CLR(fd, &ready_write_fds);
+    while(maxfd >= 0 &&
+          !FD_ISSET(maxfd, &read_fds) && !FD_ISSET(maxfd, &write_fds))
+        maxfd--;
+}
+
+int
+event_wait(const struct timeval *tv)
+{
+    struct timeval timeout = *tv;
+    int rc;
+
+    ready_read_fds = read_fds;
+    ready_write_fds = write_fds;
+    rc = select(maxfd + 1, &ready_read_fds, &ready_write_fds, NULL, &timeout);
+    if(rc < 0) {
+        FD_ZERO(&ready_read_fds);
+        FD_ZERO(&ready_write_fds);
+    }
+    return rc;
+}
+
+int
+event_ready(int fd)
+{
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return 0;
+    return (FD_ISSET(fd, &ready_read_fds) ? EVENT_READ : 0) |
+        (FD_ISSET(fd, &ready_write_fds) ? EVENT_WRITE : 0);
+}
+
+#endif
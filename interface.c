@@ -34,6 +34,7 @@ THE SOFTWARE.
 
 #include "babeld.h"
 #include "util.h"
+#include "timer.h"
 #include "kernel.h"
 #include "interface.h"
 #include "neighbour.h"
@@ -61,6 +62,40 @@ last_interface(void)
     return ifp;
 }
 
+static void
+hello_timer_handler(void *closure)
+{
+    struct interface *ifp = closure;
+    if(if_up(ifp))
+        send_hello(ifp);
+}
+
+static void
+update_timer_handler(void *closure)
+{
+    struct interface *ifp = closure;
+    if(if_up(ifp))
+        send_update(ifp, 0, NULL, 0, NULL, 0);
+}
+
+static void
+update_flush_timer_handler(void *closure)
+{
+    struct interface *ifp = closure;
+    if(if_up(ifp))
+        flushupdates(ifp);
+}
+
+static void
+flush_timer_handler(void *closure)
+{
+    struct interface *ifp = closure;
+    if(if_up(ifp)) {
+        flushupdates(ifp);
+        flushbuf(&ifp->buf, ifp);
+    }
+}
+
 struct interface *
 add_interface(char *ifname, struct interface_conf *if_conf)
 {
@@ -83,6 +118,10 @@ add_interface(char *ifname, struct interface_conf *if_conf)
     strncpy(ifp->name, ifname, IF_NAMESIZE);
     ifp->conf = if_conf ? if_conf : default_interface_conf;
     ifp->hello_seqno = (random() & 0xFFFF);
+    timer_init(&ifp->hello_timer, hello_timer_handler, ifp);
+    timer_init(&ifp->update_timer, update_timer_handler, ifp);
+    timer_init(&ifp->update_flush_timer, update_flush_timer_handler, ifp);
+    timer_init(&ifp->buf.timer, flush_timer_handler, ifp);
 
     if(interfaces == NULL)
         interfaces = ifp;
@@ -122,6 +161,10 @@ flush_interface(char *ifname)
 
     local_notify_interface(ifp, LOCAL_FLUSH);
 
+    /* Neighbours are linked into the interface, don't let them dangle. */
+    while(ifp->neighs)
+        flush_neighbour(ifp->neighs);
+
     free(ifp->ipv4);
     free(ifp);
 
@@ -153,9 +196,11 @@ update_jitter(struct interface *ifp, int urgent)
 }
 
 void
-set_timeout(struct timeval *timeout, int msecs)
+set_timeout(struct timer *timer, int msecs)
 {
-    timeval_add_msec(timeout, &now, roughly(msecs));
+    struct timeval time;
+    timeval_add_msec(&time, &now, roughly(msecs));
+    timer_set(timer, &time);
 }
 
 static int
@@ -481,23 +526,23 @@ interface_updown(struct interface *ifp, int up)
                ifp->channel,
                ifp->ipv4 ? ", IPv4" : "");
 
-        set_timeout(&ifp->hello_timeout, ifp->hello_interval);
-        set_timeout(&ifp->update_timeout, ifp->update_interval);
+        set_timeout(&ifp->hello_timer, ifp->hello_interval);
+        set_timeout(&ifp->update_timer, ifp->update_interval);
         send_hello(ifp);
         if(rc > 0)
             send_update(ifp, 0, NULL, 0, NULL, 0);
         send_multicast_request(ifp, NULL, 0, NULL, 0);
     } else {
         ifp->flags &= ~IF_UP;
+        timer_cancel(&ifp->hello_timer);
+        timer_cancel(&ifp->update_timer);
+        timer_cancel(&ifp->update_flush_timer);
+        timer_cancel(&ifp->buf.timer);
         flush_interface_routes(ifp, 0);
         ifp->buf.len = 0;
         ifp->buf.size = 0;
         free(ifp->buf.buf);
-        ifp->num_buffered_updates = 0;
-        ifp->update_bufsize = 0;
-        if(ifp->buffered_updates)
-            free(ifp->buffered_updates);
-        ifp->buffered_updates = NULL;
+        flush_update_queue(&ifp->update_queue);
         ifp->buf.buf = NULL;
         if(ifp->ifindex > 0) {
             memset(&mreq, 0, sizeof(mreq));
@@ -27,6 +27,33 @@ struct buffered_update {
     unsigned char plen;
     unsigned char src_plen;
     unsigned char pad[2];
+    int next;                   /* next update in the same group, or -1 */
+    int slot;                   /* position in the hash table */
+    /* Handles on the tables, valid while the generations match; a
+       generation of 0 means unknown. */
+    struct route_slot *route_slot;
+    struct xroute *xroute;
+    unsigned int route_generation, xroute_generation;
+};
+
+/* Pending updates with the same router-id, IPv6 before IPv4. */
+struct update_group {
+    unsigned char id[8];
+    int head[2], tail[2];
+    char unsorted[2];
+    int slot;
+};
+
+/* The set of updates waiting to be flushed on an interface.  Updates
+   are deduplicated on insertion and grouped by router-id, so that
+   flushing is a linear walk.  The arrays are kept across flushes. */
+struct update_queue {
+    struct buffered_update *updates;
+    int num_updates, max_updates;
+    int *update_hash;           /* 2 * max_updates slots */
+    struct update_group *groups;
+    int num_groups, max_groups;
+    int *group_hash;            /* 2 * max_groups slots */
 };
 
 #define IF_TYPE_DEFAULT 0
@@ -90,13 +117,15 @@ struct buffered {
     int len;
     int size;
     int flush_interval;
-    struct timeval timeout;
+    struct timer timer;
     char have_id;
     char have_nh;
-    char have_prefix;
+    /* Default prefixes for compression, indexed by v4: IPv6 uses all
+       16 bytes, IPv4 the first 4. */
+    char have_prefix[2];
     unsigned char id[8];
     unsigned char nh[4];
-    unsigned char prefix[16];
+    unsigned char prefix[2][16];
     /* Relative position of the Hello message in the send buffer, or
        (-1) if there is none. */
     int hello;
@@ -109,17 +138,16 @@ struct interface {
     unsigned short flags;
     unsigned short cost;
     int channel;
-    struct timeval hello_timeout;
-    struct timeval update_timeout;
-    struct timeval update_flush_timeout;
+    struct timer hello_timer;
+    struct timer update_timer;
+    struct timer update_flush_timer;
     char name[IF_NAMESIZE];
     unsigned char *ipv4;
     int numll;
     unsigned char (*ll)[16];
     struct buffered buf;
-    struct buffered_update *buffered_updates;
-    int num_buffered_updates;
-    int update_bufsize;
+    struct update_queue update_queue;
+    struct neighbour *neighs;   /* neighbours on this interface */
     time_t last_update_time;
     unsigned short hello_seqno;
     unsigned hello_interval;
@@ -150,7 +178,7 @@ struct interface *add_interface(char *ifname, struct interface_conf *if_conf);
 int flush_interface(char *ifname);
 unsigned jitter(struct buffered *buf, int urgent);
 unsigned update_jitter(struct interface *ifp, int urgent);
-void set_timeout(struct timeval *timeout, int msecs);
+void set_timeout(struct timer *timer, int msecs);
 int interface_updown(struct interface *ifp, int up);
 int interface_ll_address(struct interface *ifp, const unsigned char *address);
 void check_interfaces(void);
@@ -34,8 +34,12 @@ struct kernel_route {
     unsigned int ifindex;
     int proto;
     unsigned char gw[16];
+    int change;                 /* KERNEL_ROUTE_*, 0 in dumps */
 };
 
+#define KERNEL_ROUTE_NEW 1
+#define KERNEL_ROUTE_DEL 2
+
 struct kernel_addr {
     struct in6_addr addr;
     unsigned int ifindex;
@@ -88,6 +92,11 @@ int kernel_route(int operation, int table,
                  const unsigned char *gate, int ifindex, unsigned int metric,
                  const unsigned char *newgate, int newifindex,
                  unsigned int newmetric, int newtable);
+int kernel_route_sync(void);
+/* Provided by the routing code: called when a route operation that
+   kernel_route reported as successful turns out to have failed. */
+void kernel_route_failed(int operation, const struct kernel_route *route,
+                         int error);
 int kernel_dump(int operation, struct kernel_filter *filter);
 int kernel_callback(struct kernel_filter *filter);
 int if_eui64(char *ifname, int ifindex, unsigned char *eui);
@@ -54,6 +54,8 @@ THE SOFTWARE.
 #include "babeld.h"
 #include "kernel.h"
 #include "util.h"
+#include "timer.h"
+#include "event.h"
 #include "interface.h"
 #include "configuration.h"
 
@@ -223,7 +225,7 @@ write_proc(char *filename, int value)
 }
 
 struct netlink {
-    unsigned short seqno;
+    unsigned int seqno;
     int sock;
     struct sockaddr_nl sockaddr;
     socklen_t socklen;
@@ -415,63 +417,13 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
     return 0;
 
  socket_error:
+    event_del(nl->sock);
     close(nl->sock);
     nl->sock = -1;
     errno = EIO;
     return -1;
 }
 
-static int
-netlink_talk(struct nlmsghdr *nh)
-{
-
-    int rc;
-    struct sockaddr_nl nladdr;
-    struct msghdr msg;
-    struct iovec iov;
-
-    memset(&nladdr, 0, sizeof(nladdr));
-    nladdr.nl_family = AF_NETLINK;
-    nladdr.nl_pid = 0;
-
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &nladdr;
-    msg.msg_namelen = sizeof(nladdr);
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-
-    iov.iov_base = nh;
-    iov.iov_len = nh->nlmsg_len;
-
-    nh->nlmsg_flags |= NLM_F_ACK;
-    nh->nlmsg_seq = ++nl_command.seqno;
-
-    kdebugf("Sending seqno %d from address %p (talk)\n",
-            nl_command.seqno, (void*)&nl_command.seqno);
-
-    rc = sendmsg(nl_command.sock, &msg, 0);
-    if(rc < 0 && (errno == EAGAIN || errno == EINTR)) {
-        rc = wait_for_fd(1, nl_command.sock, 100);
-        if(rc <= 0) {
-            if(rc == 0)
-                errno = EAGAIN;
-        } else {
-            rc = sendmsg(nl_command.sock, &msg, 0);
-        }
-    }
-
-    if(rc < nh->nlmsg_len) {
-        int saved_errno = errno;
-        perror("sendmsg");
-        errno = saved_errno;
-        return -1;
-    }
-
-    rc = netlink_read(&nl_command, NULL, 1, NULL); /* ACK */
-
-    return rc;
-}
-
 static int
 netlink_send_dump(int type, void *data, int len) {
 
@@ -484,6 +436,8 @@ netlink_send_dump(int type, void *data, int len) {
     } buf;
     int rc;
 
+    kernel_route_sync();
+
     /* At least we should send an 'struct rtgenmsg' */
     if(data == NULL || len == 0) {
         errno = EIO;
@@ -574,6 +528,8 @@ kernel_setup(int setup)
 
         return 1;
     } else {
+        kernel_route_sync();
+
         close(dgram_socket);
         dgram_socket = -1;
 
@@ -636,11 +592,13 @@ kernel_setup_socket(int setup)
         }
 
         kernel_socket = nl_listen.sock;
+        event_add(kernel_socket, EVENT_READ);
 
         return 1;
 
     } else {
 
+        event_del(nl_listen.sock);
         close(nl_listen.sock);
         nl_listen.sock = -1;
         kernel_socket = -1;
@@ -943,6 +901,182 @@ kernel_has_ipv6_subtrees(void)
     return (kernel_older_than("Linux", 3, 11) == 0);
 }
 
+/* Route changes are not sent to the kernel one at a time.  kernel_route
+   appends them to route_batch, and kernel_route_sync writes the whole
+   batch with a single sendmsg and then collects the acknowledgements,
+   which carry consecutive sequence numbers.  Failures are reported
+   to kernel_route_failed.  The batch is bounded so that the
+   acknowledgements fit in the socket's receive buffer. */
+
+#define ROUTE_BATCH_BYTES 16384
+#define ROUTE_BATCH_MAX 128
+
+struct pending_route {
+    int operation;
+    int error;
+    struct kernel_route route;
+};
+
+static union {
+    char raw[ROUTE_BATCH_BYTES];
+    struct nlmsghdr nh;
+} route_batch;
+static int route_batch_len = 0;
+static struct pending_route pending_routes[ROUTE_BATCH_MAX];
+static int num_pending_routes = 0;
+static unsigned int pending_seqno;
+
+static int
+netlink_queue_route(struct nlmsghdr *nh, int operation,
+                    const struct kernel_route *route)
+{
+    int len = NLMSG_ALIGN(nh->nlmsg_len);
+
+    if(route_batch_len + len > ROUTE_BATCH_BYTES ||
+       num_pending_routes >= ROUTE_BATCH_MAX)
+        kernel_route_sync();
+
+    nh->nlmsg_flags |= NLM_F_ACK;
+    nh->nlmsg_seq = ++nl_command.seqno;
+    if(num_pending_routes == 0)
+        pending_seqno = nh->nlmsg_seq;
+
+    memcpy(route_batch.raw + route_batch_len, nh, nh->nlmsg_len);
+    route_batch_len += len;
+    pending_routes[num_pending_routes].operation = operation;
+    pending_routes[num_pending_routes].error = 0;
+    pending_routes[num_pending_routes].route = *route;
+    num_pending_routes++;
+    return 0;
+}
+
+static int
+netlink_read_route_acks(void)
+{
+    struct nlmsghdr buf[8192/sizeof(struct nlmsghdr)];
+    struct sockaddr_nl nladdr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct nlmsghdr *nh;
+    int len, rc, acked = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &nladdr;
+    msg.msg_namelen = sizeof(nladdr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    iov.iov_base = &buf;
+
+    while(acked < num_pending_routes) {
+        iov.iov_len = sizeof(buf);
+        len = recvmsg(nl_command.sock, &msg, 0);
+        if(len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            rc = wait_for_fd(0, nl_command.sock, 100);
+            if(rc <= 0)
+                break;
+            continue;
+        }
+        if(len <= 0) {
+            if(len < 0)
+                perror("netlink_read_route_acks: recvmsg()");
+            break;
+        }
+
+        for(nh = (struct nlmsghdr *)buf;
+            NLMSG_OK(nh, len);
+            nh = NLMSG_NEXT(nh, len)) {
+            unsigned int i = nh->nlmsg_seq - pending_seqno;
+            if(nh->nlmsg_pid != nl_command.sockaddr.nl_pid ||
+               nh->nlmsg_type != NLMSG_ERROR ||
+               i >= num_pending_routes)
+                continue;
+            pending_routes[i].error =
+                -((struct nlmsgerr *)NLMSG_DATA(nh))->error;
+            acked++;
+        }
+    }
+
+    return acked;
+}
+
+int
+kernel_route_sync(void)
+{
+    struct sockaddr_nl nladdr;
+    struct msghdr msg;
+    struct iovec iov;
+    int i, n, rc, acked = 0;
+
+    if(num_pending_routes == 0)
+        return 0;
+
+    if(nl_command.sock < 0) {
+        errno = EIO;
+        rc = -1;
+        goto fail;
+    }
+
+    memset(&nladdr, 0, sizeof(nladdr));
+    nladdr.nl_family = AF_NETLINK;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &nladdr;
+    msg.msg_namelen = sizeof(nladdr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    iov.iov_base = route_batch.raw;
+    iov.iov_len = route_batch_len;
+
+    kdebugf("Sending %d route requests, seqno %u to %u\n",
+            num_pending_routes, pending_seqno, nl_command.seqno);
+
+    rc = sendmsg(nl_command.sock, &msg, 0);
+    if(rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+        rc = wait_for_fd(1, nl_command.sock, 100);
+        if(rc <= 0) {
+            if(rc == 0)
+                errno = EAGAIN;
+            rc = -1;
+        } else {
+            rc = sendmsg(nl_command.sock, &msg, 0);
+        }
+    }
+
+    if(rc < route_batch_len) {
+        perror("kernel_route_sync: sendmsg");
+        rc = -1;
+        goto fail;
+    }
+
+    acked = netlink_read_route_acks();
+    if(acked < num_pending_routes)
+        fprintf(stderr, "kernel_route_sync: %d of %d route requests "
+                "were not acknowledged.\n",
+                num_pending_routes - acked, num_pending_routes);
+    rc = 0;
+
+ fail:
+    n = num_pending_routes;
+    num_pending_routes = 0;
+    route_batch_len = 0;
+
+    for(i = 0; i < n; i++) {
+        struct pending_route *p = &pending_routes[i];
+        if(rc < 0)
+            p->error = errno;
+        if(p->error == 0 || (p->operation == ROUTE_ADD && p->error == EEXIST))
+            continue;
+        fprintf(stderr, "kernel_route(%s %s from %s): %s\n",
+                p->operation == ROUTE_ADD ? "add" : "flush",
+                format_prefix(p->route.prefix, p->route.plen),
+                format_prefix(p->route.src_prefix, p->route.src_plen),
+                strerror(p->error));
+        kernel_route_failed(p->operation, &p->route, p->error);
+    }
+
+    return rc;
+}
+
 int
 kernel_route(int operation, int table,
              const unsigned char *dest, unsigned short plen,
@@ -955,6 +1089,7 @@ kernel_route(int operation, int table,
     union { char raw[1024]; struct nlmsghdr nh; } buf;
     struct rtmsg *rtm;
     struct rtattr *rta;
+    struct kernel_route route;
     int len = sizeof(buf.raw);
     int rc, ipv4, use_src = 0;
 
@@ -1117,7 +1252,17 @@ kernel_route(int operation, int table,
     }
     buf.nh.nlmsg_len = (char*)rta + rta->rta_len - buf.raw;
 
-    return netlink_talk(&buf.nh);
+    memset(&route, 0, sizeof(route));
+    memcpy(route.prefix, dest, 16);
+    route.plen = plen;
+    memcpy(route.src_prefix, src, 16);
+    route.src_plen = src_plen;
+    route.metric = metric;
+    route.ifindex = ifindex;
+    route.proto = RTPROT_BABEL;
+    memcpy(route.gw, gate, 16);
+
+    return netlink_queue_route(&buf.nh, operation, &route);
 }
 
 static int
@@ -1248,6 +1393,11 @@ filter_kernel_routes(struct nlmsghdr *nh, struct kernel_route *route)
     if(route->plen == 0 && route->metric >= KERNEL_INFINITY)
         return 0;
 
+    /* Dump replies are RTM_NEWROUTE too, but come with NLM_F_MULTI. */
+    if(!(nh->nlmsg_flags & NLM_F_MULTI))
+        route->change = nh->nlmsg_type == RTM_NEWROUTE ?
+            KERNEL_ROUTE_NEW : KERNEL_ROUTE_DEL;
+
     if(debug >= 2) {
         if(rc >= 0) {
             print_kernel_route(nh->nlmsg_type, rtm->rtm_protocol,
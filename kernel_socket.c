@@ -44,6 +44,8 @@ THE SOFTWARE.
 #include <net/route.h>
 
 #include "babeld.h"
+#include "timer.h"
+#include "event.h"
 #include "interface.h"
 #include "neighbour.h"
 #include "kernel.h"
@@ -276,8 +278,10 @@ kernel_setup_socket(int setup)
                         &zero, sizeof(zero));
         if(rc < 0)
             goto error;
+        event_add(kernel_socket, EVENT_READ);
         return 1;
     } else {
+        event_del(kernel_socket);
         close(kernel_socket);
         kernel_socket = -1;
         return 1;
@@ -293,6 +297,13 @@ kernel_setup_socket(int setup)
     }
 }
 
+/* Route changes are synchronous on this platform. */
+int
+kernel_route_sync(void)
+{
+    return 0;
+}
+
 int
 kernel_setup_interface(int setup, const char *ifname, int ifindex)
 {
@@ -770,6 +781,8 @@ socket_read(int sock, struct kernel_filter *filter)
         rc = parse_kernel_route(&buf.rtm, &route);
         if(rc < 0)
             return 0;
+        route.change = buf.rtm.rtm_type == RTM_DELETE ?
+            KERNEL_ROUTE_DEL : KERNEL_ROUTE_NEW;
         filter->route(&route, filter->route_closure);
         if(debug > 2)
             print_kernel_route(1,&route);
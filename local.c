@@ -31,6 +31,7 @@ THE SOFTWARE.
 #include <arpa/inet.h>
 
 #include "babeld.h"
+#include "timer.h"
 #include "interface.h"
 #include "source.h"
 #include "neighbour.h"
@@ -38,46 +39,131 @@ THE SOFTWARE.
 #include "xroute.h"
 #include "route.h"
 #include "util.h"
+#include "event.h"
 #include "configuration.h"
 #include "local.h"
 #include "version.h"
 
 int local_server_socket = -1;
-struct local_socket local_sockets[MAX_LOCAL_SOCKETS];
+struct local_socket **local_sockets = NULL;
 int num_local_sockets = 0;
+static int max_local_sockets = 0;
 int local_server_port = -1;
 char *local_server_path;
 int local_server_write = 0;
 
+/* Don't run any more commands for a client until it has read most of
+   what we have queued for it, so it cannot make us buffer without
+   bound by sending dump after dump. */
 static int
-write_timeout(int fd, const void *buf, int len)
+local_backlogged(struct local_socket *s)
 {
-    int n = 0, rc = 0;
-    const char *b = buf;
+    return s->out_n - s->out_start >= LOCAL_DUMP_QUEUE;
+}
+
+/* We wait for writability while we have something to send, and don't
+   read commands while dumping or backlogged. */
+static void
+local_update_events(struct local_socket *s)
+{
+    int events = 0;
+
+    if(s->dump == NULL && !local_backlogged(s))
+        events |= EVENT_READ;
+    if(s->dump != NULL || s->out_n > s->out_start)
+        events |= EVENT_WRITE;
+    if(s->events != events) {
+        event_add(s->fd, events);
+        s->events = events;
+    }
+}
+
+/* Stop writing to s, discarding any pending output.  The client will
+   notice the end of file and close its side. */
+static void
+local_shutdown(struct local_socket *s)
+{
+    free(s->out);
+    s->out = NULL;
+    s->out_start = s->out_n = s->out_size = s->out_unbounded = 0;
+    if(s->dump) {
+        route_stream_done(s->dump);
+        s->dump = NULL;
+        s->dump_monitor = 0;
+    }
+    local_update_events(s);
+    if(!s->closed)
+        shutdown(s->fd, 1);
+    s->closed = 1;
+}
+
+/* Queue len bytes for s, writing as much as possible straight away.
+   Bounded output is only queued if the client is keeping up with it. */
+static int
+local_write(struct local_socket *s, const char *buf, int len, int bounded)
+{
+    int pending, rc;
+
+    if(s->closed || s->closing)
+        return -1;
 
-    while(n < len) {
-        rc = write(fd, b + n, len - n);
+    pending = s->out_n - s->out_start;
+    if(bounded && pending - s->out_unbounded + len > LOCAL_MAX_OUTPUT) {
+        fprintf(stderr, "Local client is not reading, dropping it.\n");
+        local_shutdown(s);
+        return -1;
+    }
+
+    if(s->binary) {
+        s->lines++;
+    } else {
+        const char *p = buf;
+        while((p = memchr(p, '\n', buf + len - p)) != NULL) {
+            s->lines++;
+            p++;
+        }
+    }
+
+    if(pending == 0) {
+        rc = write(s->fd, buf, len);
         if(rc < 0) {
-            if(errno == EAGAIN || errno == EINTR) {
-                rc = wait_for_fd(1, fd, 100);
-                if(rc > 0) {
-                    rc = write(fd, b + n, len - n);
-                }
+            if(errno != EAGAIN && errno != EINTR) {
+                local_shutdown(s);
+                return -1;
             }
+            rc = 0;
         }
-        if(rc > 0)
-            n += rc;
-        else
-            break;
+        s->bytes_sent += rc;
+        buf += rc;
+        len -= rc;
+        if(len == 0)
+            return 1;
     }
 
-    if(n >= len)
-        return 1;
-    else {
-        if(rc >= 0)
-            errno = EAGAIN;
-        return -1;
+    if(s->out_size - s->out_n < len) {
+        if(s->out_start > 0) {
+            memmove(s->out, s->out + s->out_start, pending);
+            s->out_start = 0;
+            s->out_n = pending;
+        }
+        if(s->out_size - s->out_n < len) {
+            int size = MAX(2 * s->out_size, MAX(s->out_n + len, 4096));
+            char *out = realloc(s->out, size);
+            if(out == NULL) {
+                local_shutdown(s);
+                return -1;
+            }
+            s->out = out;
+            s->out_size = size;
+        }
     }
+
+    memcpy(s->out + s->out_n, buf, len);
+    s->out_n += len;
+    if(!bounded)
+        s->out_unbounded = s->out_n - s->out_start;
+    local_update_events(s);
+    return 1;
 }
 
 const char *
@@ -91,14 +177,338 @@ local_kind(int kind)
     }
 }
 
+/* The identifier of an object is the part of a record that follows the
+   type, of a fixed length for each type. */
+static int
+local_binary_idlen(int type)
+{
+    switch(type) {
+    case LOCAL_RECORD_INTERFACE: return IF_NAMESIZE;
+    case LOCAL_RECORD_NEIGHBOUR: return 8;
+    case LOCAL_RECORD_XROUTE: return 34;
+    case LOCAL_RECORD_ROUTE: return 8;
+    case LOCAL_RECORD_CLIENT: return 8;
+    default: return 0;
+    }
+}
+
+static unsigned char *
+local_binary_header(unsigned char *buf, int len, int kind, int type)
+{
+    DO_HTONS(buf, len);
+    buf[2] = kind;
+    buf[3] = type;
+    return buf + 4;
+}
+
+/* Object ids are addresses in memory, as in text mode. */
+static unsigned char *
+local_binary_id(unsigned char *p, const void *object)
+{
+    unsigned long long id = (unsigned long)object;
+    DO_HTONL(p, (unsigned)(id >> 32));
+    DO_HTONL(p + 4, (unsigned)(id & 0xFFFFFFFF));
+    return p + 8;
+}
+
+static unsigned char *
+local_binary_ifname(unsigned char *p, const char *name)
+{
+    memset(p, 0, IF_NAMESIZE);
+    strncpy((char*)p, name, IF_NAMESIZE - 1);
+    return p + IF_NAMESIZE;
+}
+
+/* Name, up, flags (1: has IPv6, 2: has IPv4), 2 unused octets,
+   link-local IPv6 address, IPv4 address. */
+static int
+local_binary_interface(unsigned char *buf, struct interface *ifp, int kind)
+{
+    unsigned char *p;
+    int up = if_up(ifp);
+
+    p = local_binary_header(buf, 44, kind, LOCAL_RECORD_INTERFACE);
+    p = local_binary_ifname(p, ifp->name);
+    memset(p, 0, 24);
+    p[0] = up;
+    if(up && ifp->numll > 0) {
+        p[1] |= 1;
+        memcpy(p + 4, ifp->ll[0], 16);
+    }
+    if(up && ifp->ipv4) {
+        p[1] |= 2;
+        memcpy(p + 20, ifp->ipv4, 4);
+    }
+    return 44;
+}
+
+/* Id, address, interface, reach, ureach, rxcost, txcost, cost,
+   rttcost, rtt in microseconds or 0xFFFFFFFF if unknown. */
+static int
+local_binary_neighbour(unsigned char *buf, struct neighbour *neigh, int kind)
+{
+    unsigned char *p;
+    int rtt = valid_rtt(neigh);
+
+    p = local_binary_header(buf, 60, kind, LOCAL_RECORD_NEIGHBOUR);
+    p = local_binary_id(p, neigh);
+    memcpy(p, neigh->address, 16);
+    p = local_binary_ifname(p + 16, neigh->ifp->name);
+    DO_HTONS(p, neigh->hello.reach);
+    DO_HTONS(p + 2, neigh->uhello.reach);
+    DO_HTONS(p + 4, neighbour_rxcost(neigh));
+    DO_HTONS(p + 6, neighbour_txcost(neigh));
+    DO_HTONS(p + 8, neighbour_cost(neigh));
+    DO_HTONS(p + 10, rtt ? neighbour_rttcost(neigh) : 0);
+    DO_HTONL(p + 12, rtt ? neigh->rtt : 0xFFFFFFFF);
+    return 60;
+}
+
+/* Prefix, plen, source prefix, source plen, metric. */
+static int
+local_binary_xroute(unsigned char *buf, struct xroute *xroute, int kind)
+{
+    unsigned char *p;
+
+    p = local_binary_header(buf, 40, kind, LOCAL_RECORD_XROUTE);
+    memcpy(p, xroute->prefix, 16);
+    p[16] = xroute->plen;
+    memcpy(p + 17, xroute->src_prefix, 16);
+    p[33] = xroute->src_plen;
+    DO_HTONS(p + 34, xroute->metric);
+    return 40;
+}
+
+/* Id, prefix, plen, source prefix, source plen, installed, 1 unused
+   octet, router-id, metric, refmetric, next hop, interface. */
+static int
+local_binary_route(unsigned char *buf, struct babel_route *route, int kind)
+{
+    unsigned char *p;
+
+    p = local_binary_header(buf, 92, kind, LOCAL_RECORD_ROUTE);
+    p = local_binary_id(p, route);
+    memcpy(p, route->src->prefix, 16);
+    p[16] = route->src->plen;
+    memcpy(p + 17, route->src->src_prefix, 16);
+    p[33] = route->src->src_plen;
+    p[34] = !!route->installed;
+    p[35] = 0;
+    memcpy(p + 36, route->src->id, 8);
+    DO_HTONS(p + 44, route_metric(route));
+    DO_HTONS(p + 46, route->refmetric);
+    memcpy(p + 48, route->neigh->address, 16);
+    local_binary_ifname(p + 64, route->neigh->ifp->name);
+    return 92;
+}
+
+static struct timer coalesce_timer;
+static int coalesce_timer_initialised = 0;
+
+static struct local_pending **
+local_pending_bucket(struct local_socket *s, const char *key, int keylen)
+{
+    unsigned int h = hash_bytes(HASH_INIT, key, keylen);
+    return &s->pending_table[h & (s->pending_table_size - 1)];
+}
+
+/* Each coalescing client has its own table, rebuilt from its list of
+   held-back notifications, which is also the order they are sent in. */
+static int
+grow_pending_table(struct local_socket *s)
+{
+    int n = s->pending_table_size == 0 ? 16 : 2 * s->pending_table_size;
+    struct local_pending **table, *p;
+
+    table = calloc(n, sizeof(struct local_pending*));
+    if(table == NULL)
+        return -1;
+
+    free(s->pending_table);
+    s->pending_table = table;
+    s->pending_table_size = n;
+    for(p = s->pending; p; p = p->next) {
+        struct local_pending **bucket =
+            local_pending_bucket(s, p->line + p->keyoff, p->keylen);
+        p->hash_next = *bucket;
+        *bucket = p;
+    }
+    return 1;
+}
+
+/* Send (if emit is true) or discard the notifications held back for s. */
+static void
+local_flush_pending(struct local_socket *s, int emit)
+{
+    struct local_pending *p = s->pending;
+    char buf[600];
+
+    while(p) {
+        struct local_pending *next = p->next;
+        if(emit && p->kind >= 0 && s->binary) {
+            memcpy(buf, p->line, p->len);
+            buf[2] = p->kind;
+            local_write(s, buf, p->len, 1);
+        } else if(emit && p->kind >= 0) {
+            const char *kind = local_kind(p->kind);
+            int n = strlen(kind);
+            if(n + 1 + p->len <= sizeof(buf)) {
+                memcpy(buf, kind, n);
+                buf[n] = ' ';
+                memcpy(buf + n + 1, p->line, p->len);
+                local_write(s, buf, n + 1 + p->len, 1);
+            }
+        }
+        free(p->line);
+        free(p);
+        p = next;
+    }
+
+    free(s->pending_table);
+    s->pending_table = NULL;
+    s->pending_table_size = 0;
+    s->num_pending = 0;
+    s->pending = s->last_pending = NULL;
+}
+
+static void
+local_coalesce_timeout(void *closure)
+{
+    struct timeval next = {0, 0};
+    int i;
+
+    for(i = 0; i < num_local_sockets; i++) {
+        struct local_socket *s = local_sockets[i];
+        if(s->pending == NULL)
+            continue;
+        if(timeval_compare(&s->coalesce_time, &now) <= 0)
+            local_flush_pending(s, 1);
+        else
+            timeval_min(&next, &s->coalesce_time);
+    }
+
+    if(next.tv_sec != 0)
+        timer_set(&coalesce_timer, &next);
+}
+
+/* Hold back a notification, replacing any earlier one about the same
+   object.  An object that is added and flushed within one interval is
+   never mentioned, and one that is flushed and added back is changed. */
+static int
+local_coalesce(struct local_socket *s, int kind, const char *line, int len,
+               int keyoff, int keylen)
+{
+    const char *key = line + keyoff;
+    struct local_pending *p, **bucket;
+    char *copy;
+
+    copy = malloc(len);
+    if(copy == NULL)
+        return -1;
+
+    if(s->pending_table_size == 0 ||
+       s->num_pending >= s->pending_table_size) {
+        int rc = grow_pending_table(s);
+        if(rc < 0 && s->pending_table_size == 0) {
+            free(copy);
+            return -1;
+        }
+    }
+
+    bucket = local_pending_bucket(s, key, keylen);
+    for(p = *bucket; p; p = p->hash_next) {
+        if(p->keylen == keylen &&
+           memcmp(p->line + p->keyoff, key, keylen) == 0)
+            break;
+    }
+
+    if(p == NULL) {
+        p = calloc(1, sizeof(struct local_pending));
+        if(p == NULL) {
+            free(copy);
+            return -1;
+        }
+        p->kind = kind;
+        p->hash_next = *bucket;
+        *bucket = p;
+        if(s->last_pending)
+            s->last_pending->next = p;
+        else
+            s->pending = p;
+        s->last_pending = p;
+        s->num_pending++;
+        if(s->pending == p) {
+            timeval_add_msec(&s->coalesce_time, &now, s->coalesce);
+            if(!coalesce_timer_initialised) {
+                timer_init(&coalesce_timer, local_coalesce_timeout, NULL);
+                coalesce_timer_initialised = 1;
+            }
+            if(!timer_armed(&coalesce_timer) ||
+               timeval_compare(&s->coalesce_time, &coalesce_timer.time) < 0)
+                timer_set(&coalesce_timer, &s->coalesce_time);
+        }
+    } else if(kind == LOCAL_FLUSH) {
+        p->kind = p->kind == LOCAL_ADD || p->kind < 0 ? -1 : LOCAL_FLUSH;
+    } else if(p->kind < 0) {
+        p->kind = LOCAL_ADD;
+    } else if(p->kind == LOCAL_FLUSH) {
+        p->kind = LOCAL_CHANGE;
+    }
+
+    free(p->line);
+    p->line = copy;
+    p->len = len;
+    p->keyoff = keyoff;
+    p->keylen = keylen;
+    memcpy(p->line, line, len);
+    return 1;
+}
+
+static void
+local_notify_write(struct local_socket *s, int kind,
+                   const char *buf, int len, int bounded)
+{
+    const char *line, *end;
+    int rc;
+
+    if(!bounded || s->coalesce <= 0)
+        goto write;
+
+    if(s->binary) {
+        /* The key is the record type followed by the object's id. */
+        rc = local_coalesce(s, kind, buf, len, 3,
+                            1 + local_binary_idlen(buf[3]));
+    } else {
+        /* Leave out the kind, the key is the object's type and id. */
+        line = memchr(buf, ' ', len);
+        end = line ? memchr(line + 1, ' ', buf + len - line - 1) : NULL;
+        end = end ? memchr(end + 1, ' ', buf + len - end - 1) : NULL;
+        if(end == NULL)
+            goto write;
+        line++;
+        rc = local_coalesce(s, kind, line, buf + len - line, 0, end - line);
+    }
+    if(rc >= 0)
+        return;
+
+ write:
+    local_write(s, buf, len, bounded);
+}
+
 static void
 local_notify_interface_1(struct local_socket *s,
-                         struct interface *ifp, int kind)
+                         struct interface *ifp, int kind, int bounded)
 {
     char buf[512], v4[INET_ADDRSTRLEN];
     int rc;
     int up;
 
+    if(s->binary) {
+        rc = local_binary_interface((unsigned char*)buf, ifp, kind);
+        local_notify_write(s, kind, buf, rc, bounded);
+        return;
+    }
+
     up = if_up(ifp);
     if(up && ifp->ipv4)
         inet_ntop(AF_INET, ifp->ipv4, v4, INET_ADDRSTRLEN);
@@ -118,13 +528,11 @@ local_notify_interface_1(struct local_socket *s,
     if(rc < 0 || rc >= 512)
         goto fail;
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
+    local_notify_write(s, kind, buf, rc, bounded);
     return;
 
  fail:
-    shutdown(s->fd, 1);
+    local_shutdown(s);
     return;
 }
 
@@ -133,18 +541,24 @@ local_notify_interface(struct interface *ifp, int kind)
 {
     int i;
     for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_interface_1(&local_sockets[i], ifp, kind);
+        if(local_sockets[i]->monitor)
+            local_notify_interface_1(local_sockets[i], ifp, kind, 1);
     }
 }
 
 static void
 local_notify_neighbour_1(struct local_socket *s,
-                         struct neighbour *neigh, int kind)
+                         struct neighbour *neigh, int kind, int bounded)
 {
     char buf[512], rttbuf[64];
     int rc;
 
+    if(s->binary) {
+        rc = local_binary_neighbour((unsigned char*)buf, neigh, kind);
+        local_notify_write(s, kind, buf, rc, bounded);
+        return;
+    }
+
     rttbuf[0] = '\0';
     if(valid_rtt(neigh)) {
         rc = snprintf(rttbuf, 64, " rtt %s rttcost %u",
@@ -173,13 +587,11 @@ local_notify_neighbour_1(struct local_socket *s,
     if(rc < 0 || rc >= 512)
         goto fail;
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
+    local_notify_write(s, kind, buf, rc, bounded);
     return;
 
  fail:
-    shutdown(s->fd, 1);
+    local_shutdown(s);
     return;
 }
 
@@ -188,20 +600,27 @@ local_notify_neighbour(struct neighbour *neigh, int kind)
 {
     int i;
     for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_neighbour_1(&local_sockets[i], neigh, kind);
+        if(local_sockets[i]->monitor)
+            local_notify_neighbour_1(local_sockets[i], neigh, kind, 1);
     }
 }
 
 static void
-local_notify_xroute_1(struct local_socket *s, struct xroute *xroute, int kind)
+local_notify_xroute_1(struct local_socket *s, struct xroute *xroute,
+                      int kind, int bounded)
 {
     char buf[512];
     int rc;
-    const char *dst_prefix = format_prefix(xroute->prefix,
-                                           xroute->plen);
-    const char *src_prefix = format_prefix(xroute->src_prefix,
-                                           xroute->src_plen);
+    const char *dst_prefix, *src_prefix;
+
+    if(s->binary) {
+        rc = local_binary_xroute((unsigned char*)buf, xroute, kind);
+        local_notify_write(s, kind, buf, rc, bounded);
+        return;
+    }
+
+    dst_prefix = format_prefix(xroute->prefix, xroute->plen);
+    src_prefix = format_prefix(xroute->src_prefix, xroute->src_plen);
 
     rc = snprintf(buf, 512, "%s xroute %s-%s prefix %s from %s metric %d\n",
                   local_kind(kind), dst_prefix, src_prefix,
@@ -210,13 +629,11 @@ local_notify_xroute_1(struct local_socket *s, struct xroute *xroute, int kind)
     if(rc < 0 || rc >= 512)
         goto fail;
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
+    local_notify_write(s, kind, buf, rc, bounded);
     return;
 
  fail:
-    shutdown(s->fd, 1);
+    local_shutdown(s);
     return;
 }
 
@@ -225,20 +642,27 @@ local_notify_xroute(struct xroute *xroute, int kind)
 {
     int i;
     for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_xroute_1(&local_sockets[i], xroute, kind);
+        if(local_sockets[i]->monitor)
+            local_notify_xroute_1(local_sockets[i], xroute, kind, 1);
     }
 }
 
 static void
-local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind)
+local_notify_route_1(struct local_socket *s, struct babel_route *route,
+                     int kind, int bounded)
 {
     char buf[512];
     int rc;
-    const char *dst_prefix = format_prefix(route->src->prefix,
-                                           route->src->plen);
-    const char *src_prefix = format_prefix(route->src->src_prefix,
-                                           route->src->src_plen);
+    const char *dst_prefix, *src_prefix;
+
+    if(s->binary) {
+        rc = local_binary_route((unsigned char*)buf, route, kind);
+        local_notify_write(s, kind, buf, rc, bounded);
+        return;
+    }
+
+    dst_prefix = format_prefix(route->src->prefix, route->src->plen);
+    src_prefix = format_prefix(route->src->src_prefix, route->src->src_plen);
 
     rc = snprintf(buf, 512,
                   "%s route %lx prefix %s from %s installed %s "
@@ -255,13 +679,11 @@ local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind
     if(rc < 0 || rc >= 512)
         goto fail;
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
+    local_notify_write(s, kind, buf, rc, bounded);
     return;
 
  fail:
-    shutdown(s->fd, 1);
+    local_shutdown(s);
     return;
 }
 
@@ -270,25 +692,140 @@ local_notify_route(struct babel_route *route, int kind)
 {
     int i;
     for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_route_1(&local_sockets[i], route, kind);
+        struct local_socket *s = local_sockets[i];
+        if(!s->monitor)
+            continue;
+        if(s->dump_monitor && !route_stream_passed(s->dump, route))
+            continue;
+        local_notify_route_1(s, route, kind, 1);
+    }
+}
+
+/* Id, monitor, binary, 2 unused octets, coalescing interval in msecs,
+   octets queued, lines or records produced, commands, octets sent. */
+static int
+local_binary_client(unsigned char *buf, struct local_socket *c)
+{
+    unsigned char *p;
+
+    p = local_binary_header(buf, 40, LOCAL_ADD, LOCAL_RECORD_CLIENT);
+    p = local_binary_id(p, c);
+    p[0] = c->monitor;
+    p[1] = c->binary;
+    p[2] = p[3] = 0;
+    DO_HTONL(p + 4, c->coalesce);
+    DO_HTONL(p + 8, c->out_n - c->out_start);
+    DO_HTONL(p + 12, c->lines);
+    DO_HTONL(p + 16, c->commands);
+    DO_HTONL(p + 20, (unsigned)(c->bytes_sent >> 32));
+    DO_HTONL(p + 24, (unsigned)(c->bytes_sent & 0xFFFFFFFF));
+    return 40;
+}
+
+static void
+local_dump_clients(struct local_socket *s)
+{
+    char buf[512];
+    int i, rc;
+
+    for(i = 0; i < num_local_sockets; i++) {
+        struct local_socket *c = local_sockets[i];
+        if(s->binary) {
+            rc = local_binary_client((unsigned char*)buf, c);
+        } else {
+            rc = snprintf(buf, 512,
+                          "add client %lx monitor %s binary %s "
+                          "coalesce %s queued %d lines %u commands %u "
+                          "sent %llu\n",
+                          (unsigned long)c,
+                          c->monitor ? "true" : "false",
+                          c->binary ? "true" : "false",
+                          format_thousands(c->coalesce),
+                          c->out_n - c->out_start, c->lines, c->commands,
+                          c->bytes_sent);
+            if(rc < 0 || rc >= 512)
+                continue;
+        }
+        local_write(s, buf, rc, 0);
     }
 }
 
 static void
-local_notify_all_1(struct local_socket *s)
+local_binary_reply(struct local_socket *s, int status, const char *message)
+{
+    unsigned char buf[104], *p;
+    int n = message ? MIN(strlen(message), 99) : 0;
+
+    p = local_binary_header(buf, 5 + n, 0, LOCAL_RECORD_REPLY);
+    p[0] = status;
+    if(n > 0)
+        memcpy(p + 1, message, n);
+    local_write(s, (char*)buf, 5 + n, 0);
+}
+
+static void
+local_reply(struct local_socket *s, int status, const char *message)
+{
+    char buf[120];
+    int rc;
+
+    if(s->binary) {
+        local_binary_reply(s, status, message);
+        return;
+    }
+
+    rc = snprintf(buf, sizeof(buf), "%s%s%s\n",
+                  status == LOCAL_REPLY_OK ? "ok" :
+                  status == LOCAL_REPLY_NO ? "no" : "bad",
+                  message ? " " : "", message ? message : "");
+    if(rc < 0 || rc >= sizeof(buf))
+        rc = snprintf(buf, sizeof(buf), "%s\n",
+                      status == LOCAL_REPLY_NO ? "no" : "bad");
+    local_write(s, buf, rc, 0);
+}
+
+/* Send routes to s until it has enough to chew on.  We only stop between
+   slots, so that the stream remains valid while the table changes. */
+static void
+local_dump_routes(struct local_socket *s)
+{
+    int n = 0;
+
+    while(s->dump) {
+        struct babel_route *route;
+        if(route_stream_between_slots(s->dump) &&
+           (n >= LOCAL_DUMP_CHUNK ||
+            s->out_n - s->out_start >= LOCAL_DUMP_QUEUE))
+            return;
+        route = route_stream_next(s->dump);
+        if(route == NULL) {
+            route_stream_done(s->dump);
+            s->dump = NULL;
+            s->dump_monitor = 0;
+            local_reply(s, LOCAL_REPLY_OK, NULL);
+            local_update_events(s);
+            return;
+        }
+        local_notify_route_1(s, route, LOCAL_ADD, 0);
+        n++;
+    }
+}
+
+/* Interfaces, neighbours and xroutes are sent straight away, routes are
+   sent as the client reads them. */
+static void
+local_dump(struct local_socket *s, int monitor)
 {
     struct interface *ifp;
     struct neighbour *neigh;
     struct xroute_stream *xroutes;
-    struct route_stream *routes;
 
     FOR_ALL_INTERFACES(ifp) {
-        local_notify_interface_1(s, ifp, LOCAL_ADD);
+        local_notify_interface_1(s, ifp, LOCAL_ADD, 0);
     }
 
     FOR_ALL_NEIGHBOURS(neigh) {
-        local_notify_neighbour_1(s, neigh, LOCAL_ADD);
+        local_notify_neighbour_1(s, neigh, LOCAL_ADD, 0);
     }
 
     xroutes = xroute_stream();
@@ -297,102 +834,166 @@ local_notify_all_1(struct local_socket *s)
             struct xroute *xroute = xroute_stream_next(xroutes);
             if(xroute == NULL)
                 break;
-            local_notify_xroute_1(s, xroute, LOCAL_ADD);
+            local_notify_xroute_1(s, xroute, LOCAL_ADD, 0);
         }
         xroute_stream_done(xroutes);
     }
 
-    routes = route_stream(0);
-    if(routes) {
-        while(1) {
-            struct babel_route *route = route_stream_next(routes);
-            if(route == NULL)
-                break;
-            local_notify_route_1(s, route, LOCAL_ADD);
-        }
-        route_stream_done(routes);
+    if(s->closed)
+        return;
+
+    s->dump = route_stream(0);
+    if(s->dump == NULL) {
+        local_reply(s, LOCAL_REPLY_OK, NULL);
+        return;
     }
-    return;
+    s->dump_monitor = monitor;
+    local_dump_routes(s);
+    local_update_events(s);
 }
 
-int
-local_read(struct local_socket *s)
+/* Execute the commands buffered for s, stopping at a dump or when the
+   client is backlogged. */
+static void
+local_parse(struct local_socket *s)
 {
-    int rc, n;
+    int rc, n, interval, status, binary;
     char *eol;
-    char reply[100] = "ok\n";
-    const char *message = NULL;
-
-    if(s->buf == NULL)
-        s->buf = malloc(LOCAL_BUFSIZE);
-    if(s->buf == NULL)
-        return -1;
+    const char *message;
 
-    if(s->n >= LOCAL_BUFSIZE) {
-        errno = ENOSPC;
-        goto fail;
-    }
-
-    rc = read(s->fd, s->buf + s->n, LOCAL_BUFSIZE - s->n);
-    if(rc <= 0)
-        return rc;
-    s->n += rc;
-
-    while(s->n > 0) {
+    while(s->n > 0 && s->dump == NULL && !local_backlogged(s)) {
         eol = memchr(s->buf, '\n', s->n);
         if(eol == NULL)
             break;
         n = eol + 1 - s->buf;
 
-        rc = parse_config_from_string(s->buf, n, &message);
+        status = LOCAL_REPLY_OK;
+        message = NULL;
+        binary = s->binary;
+        rc = parse_config_from_string(s->buf, n, &message, &interval);
+        s->commands++;
+        if(s->n > n)
+            memmove(s->buf, s->buf + n, s->n - n);
+        s->n -= n;
+
         switch(rc) {
         case CONFIG_ACTION_DONE:
             break;
         case CONFIG_ACTION_QUIT:
-            shutdown(s->fd, 1);
-            reply[0] = '\0';
+            /* Let the client read what we've already sent. */
+            if(s->out_n > s->out_start)
+                s->closing = 1;
+            else
+                local_shutdown(s);
+            status = -1;
             break;
         case CONFIG_ACTION_DUMP:
-            local_notify_all_1(s);
+            local_flush_pending(s, 1);
+            local_dump(s, 0);
+            status = -1;
             break;
         case CONFIG_ACTION_MONITOR:
-            local_notify_all_1(s);
+            local_flush_pending(s, 1);
+            s->coalesce = interval;
+            local_dump(s, !s->monitor);
             s->monitor = 1;
+            status = -1;
             break;
         case CONFIG_ACTION_UNMONITOR:
+            local_flush_pending(s, 0);
             s->monitor = 0;
+            s->coalesce = 0;
+            break;
+        case CONFIG_ACTION_DUMP_CLIENTS:
+            local_dump_clients(s);
+            break;
+        case CONFIG_ACTION_BINARY:
+            /* Anything held back was formatted as text. */
+            local_flush_pending(s, 1);
+            binary = 1;
             break;
         case CONFIG_ACTION_NO:
-            snprintf(reply, sizeof(reply), "no%s%s\n",
-                     message ? " " : "", message ? message : "");
+            status = LOCAL_REPLY_NO;
             break;
         default:
-            snprintf(reply, sizeof(reply), "bad\n");
+            status = LOCAL_REPLY_BAD;
         }
 
-        if(reply[0] != '\0') {
-            rc = write_timeout(s->fd, reply, strlen(reply));
-            if(rc < 0) {
-                goto fail;
-            }
-        }
-        if(s->n > n)
-            memmove(s->buf, s->buf + n, s->n - n);
-        s->n -= n;
+        /* The reply to "binary" is still in text. */
+        if(status >= 0)
+            local_reply(s, status, message);
+        s->binary = binary;
     }
 
     if(s->n == 0) {
         free(s->buf);
         s->buf = NULL;
     }
+}
+
+int
+local_read(struct local_socket *s)
+{
+    int rc;
+
+    if(s->buf == NULL)
+        s->buf = malloc(LOCAL_BUFSIZE);
+    if(s->buf == NULL)
+        return -1;
+
+    if(s->n >= LOCAL_BUFSIZE) {
+        errno = ENOSPC;
+        goto fail;
+    }
 
+    rc = read(s->fd, s->buf + s->n, LOCAL_BUFSIZE - s->n);
+    if(rc <= 0)
+        return rc;
+    s->n += rc;
+
+    local_parse(s);
     return 1;
 
  fail:
-    shutdown(s->fd, 1);
+    local_shutdown(s);
     return -1;
 }
 
+/* Called when s becomes writable. */
+void
+local_flush(struct local_socket *s)
+{
+    int rc;
+
+    if(s->out_n > s->out_start) {
+        rc = write(s->fd, s->out + s->out_start, s->out_n - s->out_start);
+        if(rc < 0) {
+            if(errno != EAGAIN && errno != EINTR)
+                local_shutdown(s);
+            return;
+        }
+        s->out_start += rc;
+        s->out_unbounded = MAX(s->out_unbounded - rc, 0);
+        s->bytes_sent += rc;
+    }
+
+    if(s->out_n == s->out_start) {
+        free(s->out);
+        s->out = NULL;
+        s->out_start = s->out_n = s->out_size = s->out_unbounded = 0;
+        if(s->closing) {
+            local_shutdown(s);
+            return;
+        }
+    }
+
+    if(s->dump)
+        local_dump_routes(s);
+    if(s->dump == NULL && s->n > 0)
+        local_parse(s);
+    local_update_events(s);
+}
+
 int
 local_header(struct local_socket *s)
 {
@@ -407,28 +1008,39 @@ local_header(struct local_socket *s)
                   BABELD_VERSION, host, format_eui64(myid));
     if(rc < 0 || rc >= 512)
         goto fail;
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
-
-    return 1;
+    return local_write(s, buf, rc, 0);
 
  fail:
-    shutdown(s->fd, 1);
+    local_shutdown(s);
     return -1;
 }
 
 struct local_socket *
 local_socket_create(int fd)
 {
+    struct local_socket *s;
+
     if(num_local_sockets >= MAX_LOCAL_SOCKETS)
         return NULL;
 
-    memset(&local_sockets[num_local_sockets], 0, sizeof(struct local_socket));
-    local_sockets[num_local_sockets].fd = fd;
-    num_local_sockets++;
+    if(num_local_sockets >= max_local_sockets) {
+        int n = max_local_sockets == 0 ? 4 : 2 * max_local_sockets;
+        struct local_socket **new_sockets =
+            realloc(local_sockets, n * sizeof(struct local_socket*));
+        if(new_sockets == NULL)
+            return NULL;
+        local_sockets = new_sockets;
+        max_local_sockets = n;
+    }
+
+    s = calloc(1, sizeof(struct local_socket));
+    if(s == NULL)
+        return NULL;
+    s->fd = fd;
+    s->events = EVENT_READ;
+    local_sockets[num_local_sockets++] = s;
 
-    return &local_sockets[num_local_sockets - 1];
+    return s;
 }
 
 void
@@ -439,9 +1051,13 @@ local_socket_destroy(int i)
         return;
     }
 
-    free(local_sockets[i].buf);
-    close(local_sockets[i].fd);
+    local_flush_pending(local_sockets[i], 0);
+    if(local_sockets[i]->dump)
+        route_stream_done(local_sockets[i]->dump);
+    free(local_sockets[i]->buf);
+    free(local_sockets[i]->out);
+    event_del(local_sockets[i]->fd);
+    close(local_sockets[i]->fd);
+    free(local_sockets[i]);
     local_sockets[i] = local_sockets[--num_local_sockets];
-    VALGRIND_MAKE_MEM_UNDEFINED(local_sockets + num_local_sockets,
-                                sizeof(struct local_socket));
 }
@@ -23,26 +23,89 @@ THE SOFTWARE.
 struct neighbour;
 struct babel_route;
 struct xroute;
+struct route_stream;
 
 #define LOCAL_FLUSH 0
 #define LOCAL_ADD 1
 #define LOCAL_CHANGE 2
 
 #ifndef MAX_LOCAL_SOCKETS
-#define MAX_LOCAL_SOCKETS 4
+#define MAX_LOCAL_SOCKETS 256
 #endif
 
 #define LOCAL_BUFSIZE 1024
 
+/* How far behind a monitoring client may fall before we give up on it. */
+#ifndef LOCAL_MAX_OUTPUT
+#define LOCAL_MAX_OUTPUT (1024 * 1024)
+#endif
+
+/* Routes are dumped in chunks of roughly this many routes, as long as
+   the client has less than LOCAL_DUMP_QUEUE octets queued. */
+#define LOCAL_DUMP_CHUNK 256
+#define LOCAL_DUMP_QUEUE 65536
+
+/* A notification held back by a coalescing monitor, keyed by the
+   object's type and identifier (e.g. "route 55d4c2a0").  In text mode,
+   line is the notification without its leading kind. */
+struct local_pending {
+    int kind;                   /* -1 if there is nothing left to say */
+    int keyoff, keylen;
+    int len;
+    char *line;
+    struct local_pending *next;
+    struct local_pending *hash_next;
+};
+
+/* Binary records, sent instead of text once a client has asked for
+   "binary".  Every record starts with its length (2 octets, including
+   this header), kind and type.  Integers are in network byte order,
+   addresses and prefixes take 16 octets, IPv4 being IPv4-mapped. */
+#define LOCAL_RECORD_REPLY 0
+#define LOCAL_RECORD_INTERFACE 1
+#define LOCAL_RECORD_NEIGHBOUR 2
+#define LOCAL_RECORD_XROUTE 3
+#define LOCAL_RECORD_ROUTE 4
+#define LOCAL_RECORD_CLIENT 5
+
+#define LOCAL_REPLY_OK 0
+#define LOCAL_REPLY_NO 1
+#define LOCAL_REPLY_BAD 2
+
 struct local_socket {
     int fd;
     char *buf;
     int n;
     int monitor;
+    int binary;
+    /* A dump in progress, during which we don't read commands.  If the
+       dump started monitoring, notifications about routes it hasn't
+       reached yet are not sent, since they will be dumped. */
+    struct route_stream *dump;
+    int dump_monitor;
+    /* If non-zero, notifications are coalesced for that many msecs. */
+    int coalesce;
+    struct timeval coalesce_time;
+    struct local_pending **pending_table;
+    int pending_table_size, num_pending;
+    struct local_pending *pending, *last_pending;
+    /* Output not yet accepted by the kernel, from out + out_start to
+       out + out_n.  The first out_unbounded bytes of it are replies to
+       commands, which don't count against LOCAL_MAX_OUTPUT. */
+    char *out;
+    int out_start, out_n, out_size;
+    int out_unbounded;
+    int events;                 /* registered with the event loop */
+    int closing;
+    int closed;
+    /* Accounting, reported by dump-clients. */
+    unsigned long long bytes_sent;
+    unsigned int lines;
+    unsigned int commands;
 };
 
 extern int local_server_socket;
-extern struct local_socket local_sockets[MAX_LOCAL_SOCKETS];
+extern struct local_socket **local_sockets;
 extern int num_local_sockets;
 extern int local_server_port;
 extern char *local_server_path;
@@ -52,6 +115,7 @@ void local_notify_neighbour(struct neighbour *neigh, int kind);
 void local_notify_xroute(struct xroute *xroute, int kind);
 void local_notify_route(struct babel_route *route, int kind);
 int local_read(struct local_socket *s);
+void local_flush(struct local_socket *s);
 int local_header(struct local_socket *s);
 struct local_socket *local_socket_create(int fd);
 void local_socket_destroy(int i);
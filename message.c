@@ -23,6 +23,7 @@ THE SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <assert.h>
 #include <sys/time.h>
 #include <netinet/in.h>
@@ -30,6 +31,7 @@ THE SOFTWARE.
 
 #include "babeld.h"
 #include "util.h"
+#include "timer.h"
 #include "net.h"
 #include "interface.h"
 #include "source.h"
@@ -48,6 +50,9 @@ int split_horizon = 1;
 unsigned short myseqno = 0;
 struct timeval seqno_time = {0, 0};
 
+/* Number of updates encoded, and bytes used for them. */
+unsigned long updates_sent = 0, update_bytes_sent = 0;
+
 #define MAX_CHANNEL_HOPS 20
 
 /* Checks whether an AE exists or must be silently ignored */
@@ -64,7 +69,7 @@ network_prefix(int ae, int plen, unsigned int omitted,
                const unsigned char *p, const unsigned char *dp,
                unsigned int len, unsigned char *p_r)
 {
-    unsigned pb;
+    unsigned pb, bits, i;
     unsigned char prefix[16];
     int ret = -1;
 
@@ -87,35 +92,45 @@ network_prefix(int ae, int plen, unsigned int omitted,
     case 1:
         if(omitted > 4 || pb > 4 || (pb > omitted && len < pb - omitted))
             return -1;
-        memcpy(prefix, v4prefix, 12);
         if(omitted) {
             if(dp == NULL || !v4mapped(dp)) return -1;
-            memcpy(prefix, dp, 12 + omitted);
+            memcpy(prefix, dp, 16);
+        } else {
+            memcpy(prefix, v4prefix, 16);
         }
-        if(pb > omitted) memcpy(prefix + 12 + omitted, p, pb - omitted);
+        for(i = omitted; i < pb; i++)
+            prefix[12 + i] = p[i - omitted];
         ret = pb - omitted;
         break;
     case 2:
         if(omitted > 16 || (pb > omitted && len < pb - omitted)) return -1;
         if(omitted) {
             if(dp == NULL || v4mapped(dp)) return -1;
-            memcpy(prefix, dp, omitted);
+            memcpy(prefix, dp, 16);
         }
-        if(pb > omitted) memcpy(prefix + omitted, p, pb - omitted);
+        for(i = omitted; i < pb; i++)
+            prefix[i] = p[i - omitted];
         ret = pb - omitted;
         break;
     case 3:
         if(pb > 8 && len < pb - 8) return -1;
         prefix[0] = 0xfe;
         prefix[1] = 0x80;
-        if(pb > 8) memcpy(prefix + 8, p, pb - 8);
+        for(i = 8; i < pb; i++)
+            prefix[i] = p[i - 8];
         ret = pb - 8;
         break;
     default:
         return -1;
     }
 
-    normalize_prefix(p_r, prefix, plen < 0 ? 128 : ae == 1 ? plen + 96 : plen);
+    /* Normalise in place: clear whatever lies past the prefix length. */
+    bits = plen < 0 ? 128 : ae == 1 ? plen + 96 : plen;
+    if(bits <= 120)
+        memset(prefix + (bits + 7) / 8, 0, 16 - (bits + 7) / 8);
+    if(bits % 8 != 0)
+        prefix[bits / 8] &= 0xFF << (8 - bits % 8);
+    memcpy(p_r, prefix, 16);
     return ret;
 }
 
@@ -446,27 +461,461 @@ network_address(int ae, const unsigned char *a, unsigned int len,
     return network_prefix(ae, -1, 0, a, NULL, len, a_r);
 }
 
-void
-parse_packet(const unsigned char *from, struct interface *ifp,
-             const unsigned char *packet, int packetlen)
-{
-    int i;
-    const unsigned char *message;
-    unsigned char type, len;
-    int bodylen;
+/* Per-packet state shared by the TLV parsers. */
+struct parse_state {
+    const unsigned char *from;
+    struct interface *ifp;
     struct neighbour *neigh;
-    int have_router_id = 0, have_v4_prefix = 0, have_v6_prefix = 0,
-        have_v4_nh = 0, have_v6_nh = 0;
+    int have_router_id, have_v4_prefix, have_v6_prefix,
+        have_v4_nh, have_v6_nh;
     unsigned char router_id[8], v4_prefix[16], v6_prefix[16],
         v4_nh[16], v6_nh[16];
-    int have_hello_rtt = 0;
+    int have_hello_rtt;
     /* Content of the RTT sub-TLV on IHU messages. */
-    unsigned int hello_send_us = 0, hello_rtt_receive_time = 0;
+    unsigned int hello_send_us, hello_rtt_receive_time;
+};
+
+/* Each TLV parser gets the TLV including its type and length bytes, and
+   returns -1 if the TLV is malformed. */
+
+static int
+parse_ack_req_tlv(struct parse_state *s, const unsigned char *message,
+                  int len)
+{
+    unsigned short nonce, interval;
+    if(len < 6) return -1;
+    DO_NTOHS(nonce, message + 4);
+    DO_NTOHS(interval, message + 6);
+    debugf("Received ack-req (%04X %d) from %s on %s.\n",
+           nonce, interval, format_address(s->from), s->ifp->name);
+    if(parse_other_subtlv(message + 8, len - 6) < 0)
+        return 0;
+    send_ack(s->neigh, nonce, interval);
+    return 0;
+}
+
+static int
+parse_ack_tlv(struct parse_state *s, const unsigned char *message, int len)
+{
+    debugf("Received ack from %s on %s.\n",
+           format_address(s->from), s->ifp->name);
+    parse_other_subtlv(message + 4, len - 2);
+    /* Nothing right now */
+    return 0;
+}
+
+static int
+parse_hello_tlv(struct parse_state *s, const unsigned char *message, int len)
+{
+    struct neighbour *neigh = s->neigh;
+    unsigned short seqno, interval;
+    int unicast, changed, have_timestamp, rc;
+    unsigned int timestamp;
+    if(len < 6) return -1;
+    unicast = !!(message[2] & 0x80);
+    DO_NTOHS(seqno, message + 4);
+    DO_NTOHS(interval, message + 6);
+    debugf("Received hello %d (%d) from %s on %s.\n",
+           seqno, interval, format_address(s->from), s->ifp->name);
+    /* Sub-TLV handling. */
+    rc = parse_hello_subtlv(message + 8, len - 6,
+                            &timestamp, &have_timestamp);
+    if(rc < 0)
+        return 0;
+    changed = update_neighbour(neigh,
+                               unicast ? &neigh->uhello : &neigh->hello,
+                               unicast, seqno, interval);
+    update_neighbour_metric(neigh, changed);
+    if(interval > 0)
+        /* Multiply by 3/2 to allow hellos to expire. */
+        schedule_neighbours_check(interval * 15, 0);
+    if(have_timestamp) {
+        neigh->hello_send_us = timestamp;
+        neigh->hello_rtt_receive_time = now;
+        s->have_hello_rtt = 1;
+    }
+    return 0;
+}
+
+static int
+parse_ihu_tlv(struct parse_state *s, const unsigned char *message, int len)
+{
+    struct neighbour *neigh = s->neigh;
+    unsigned short txcost, interval;
+    unsigned char address[16];
+    int rc, changed;
+    if(len < 6) return -1;
+    if(!known_ae(message[2])) {
+        debugf("Received IHU with unknown AE %d. Ignoring.\n", message[2]);
+        return 0;
+    }
+    DO_NTOHS(txcost, message + 4);
+    DO_NTOHS(interval, message + 6);
+    rc = network_address(message[2], message + 8, len - 6, address);
+    if(rc < 0) return -1;
+    debugf("Received ihu %d (%d) from %s on %s for %s.\n",
+           txcost, interval, format_address(s->from), s->ifp->name,
+           format_address(address));
+    if(message[2] != 0 && !interface_ll_address(s->ifp, address))
+        return 0;
+    rc = parse_ihu_subtlv(message + 8 + rc, len - 6 - rc,
+                          &s->hello_send_us, &s->hello_rtt_receive_time,
+                          NULL);
+    if(rc < 0)
+        return 0;
+    changed = txcost != neigh->txcost;
+    neigh->txcost = txcost;
+    neigh->ihu_time = now;
+    neigh->ihu_interval = interval;
+    update_neighbour_metric(neigh, changed);
+    if(interval > 0)
+        /* Multiply by 3/2 to allow neighbours to expire. */
+        schedule_neighbours_check(interval * 45, 0);
+    return 0;
+}
+
+static int
+parse_router_id_tlv(struct parse_state *s, const unsigned char *message,
+                    int len)
+{
+    if(len < 10) {
+        s->have_router_id = 0;
+        return -1;
+    }
+    memcpy(s->router_id, message + 4, 8);
+    s->have_router_id = 1;
+    debugf("Received router-id %s from %s on %s.\n",
+           format_eui64(s->router_id), format_address(s->from),
+           s->ifp->name);
+    parse_other_subtlv(message + 12, len - 10);
+    return 0;
+}
+
+static int
+parse_nh_tlv(struct parse_state *s, const unsigned char *message, int len)
+{
+    unsigned char nh[16];
+    int rc;
+    if(len < 2) {
+        s->have_v4_nh = 0;
+        s->have_v6_nh = 0;
+        return -1;
+    }
+    rc = network_address(message[2], message + 4, len - 2, nh);
+    if(!known_ae(message[2])) {
+        debugf("Received NH with unknown AE %d. Ignoring.\n", message[2]);
+        return 0;
+    }
+    if(message[2] == 0) {
+        debugf("Received NH with bad AE 0. Error.\n");
+        return -1;
+    }
+    if(rc < 0) {
+        s->have_v4_nh = 0;
+        s->have_v6_nh = 0;
+        return -1;
+    }
+    debugf("Received nh %s (%d) from %s on %s.\n",
+           format_address(nh), message[2],
+           format_address(s->from), s->ifp->name);
+    if(message[2] == 1) {
+        memcpy(s->v4_nh, nh, 16);
+        s->have_v4_nh = 1;
+    } else {
+        memcpy(s->v6_nh, nh, 16);
+        s->have_v6_nh = 1;
+    }
+    parse_other_subtlv(message + 4 + rc, len - 2 - rc);
+    return 0;
+}
+
+static int
+parse_update_tlv(struct parse_state *s, const unsigned char *message,
+                 int len)
+{
+    struct interface *ifp = s->ifp;
+    unsigned char prefix[16], src_prefix[16], *nh;
+    unsigned char plen, src_plen;
+    unsigned char channels[MAX_CHANNEL_HOPS];
+    int channels_len = MAX_CHANNEL_HOPS;
+    unsigned short interval, seqno, metric;
+    int rc, parsed_len, is_ss, ae;
+    if(len < 10) {
+        if(len < 2 || message[3] & 0x80)
+            s->have_v4_prefix = s->have_v6_prefix = 0;
+        return -1;
+    }
+    ae = message[2];
+    if(!known_ae(ae)) {
+        debugf("Received update with unknown AE %d. Ignoring.\n", ae);
+        return 0;
+    }
+    DO_NTOHS(interval, message + 6);
+    DO_NTOHS(seqno, message + 8);
+    DO_NTOHS(metric, message + 10);
+    if(message[5] == 0 || (ae == 1 ? s->have_v4_prefix : s->have_v6_prefix))
+        rc = network_prefix(ae, message[4], message[5], message + 12,
+                            ae == 1 ? s->v4_prefix : s->v6_prefix,
+                            len - 10, prefix);
+    else
+        rc = -1;
+    if(ae == 1) {
+        v4tov6(src_prefix, zeroes);
+        src_plen = 96;
+    } else {
+        memcpy(src_prefix, zeroes, 16);
+        src_plen = 0;
+    }
+    if(rc < 0) {
+        if(message[3] & 0x80)
+            s->have_v4_prefix = s->have_v6_prefix = 0;
+        return -1;
+    }
+    parsed_len = 10 + rc;
+
+    plen = message[4] + (ae == 1 ? 96 : 0);
+
+    if(message[3] & 0x80) {
+        if(ae == 1) {
+            memcpy(s->v4_prefix, prefix, 16);
+            s->have_v4_prefix = 1;
+        } else {
+            memcpy(s->v6_prefix, prefix, 16);
+            s->have_v6_prefix = 1;
+        }
+    }
+    if(message[3] & 0x40) {
+        if(ae == 1) {
+            memset(s->router_id, 0, 4);
+            memcpy(s->router_id + 4, prefix + 12, 4);
+        } else {
+            memcpy(s->router_id, prefix + 8, 8);
+        }
+        s->have_router_id = 1;
+    }
+    if(metric < INFINITY && !s->have_router_id && ae != 0) {
+        fprintf(stderr, "Received prefix with no router id.\n");
+        return -1;
+    }
+    debugf("Received update%s%s for %s from %s on %s.\n",
+           (message[3] & 0x80) ? "/prefix" : "",
+           (message[3] & 0x40) ? "/id" : "",
+           format_prefix(prefix, plen),
+           format_address(s->from), ifp->name);
+    if(ae == 1) {
+        if(s->have_v4_nh) {
+            nh = s->v4_nh;
+        } else {
+            if(metric < INFINITY)
+                return -1;
+            nh = NULL;
+        }
+    } else if(s->have_v6_nh) {
+        nh = s->v6_nh;
+    } else {
+        nh = s->neigh->address;
+    }
+
+    rc = parse_update_subtlv(ifp, metric, ae,
+                             message + 2 + parsed_len,
+                             len - parsed_len, channels, &channels_len,
+                             src_prefix, &src_plen);
+    if(rc < 0)
+        return 0;
+
+    if(ae == 0) {
+        if(metric < 0xFFFF) {
+            fprintf(stderr,
+                    "Received wildcard update with finite metric.\n");
+            return 0;
+        }
+        if(src_plen > 0) {
+            fprintf(stderr,
+                    "Received wildcard update with source prefix.\n");
+            return 0;
+        }
+        retract_neighbour_routes(s->neigh);
+        return 0;
+    }
+
+    is_ss = !is_default(src_prefix, src_plen);
+    debugf("Received update%s%s for dst %s%s%s from %s on %s.\n",
+           (message[3] & 0x80) ? "/prefix" : "",
+           (message[3] & 0x40) ? "/id" : "",
+           format_prefix(prefix, plen),
+           is_ss ? " src " : "",
+           is_ss ? format_prefix(src_prefix, src_plen) : "",
+           format_address(s->from), ifp->name);
+
+    if(ae == 1 && !ifp->ipv4)
+        return 0;
+
+    update_route(s->have_router_id ? s->router_id : NULL,
+                 prefix, plen, src_prefix, src_plen, seqno,
+                 metric, interval, s->neigh, nh,
+                 channels, channels_len);
+    return 0;
+}
 
-    if((ifp->flags & IF_TIMESTAMPS) != 0) {
-        /* We want to track exactly when we received this packet. */
-        gettime(&now);
+static int
+parse_request_tlv(struct parse_state *s, const unsigned char *message,
+                  int len)
+{
+    struct neighbour *neigh = s->neigh;
+    unsigned char prefix[16], src_prefix[16], plen, src_plen;
+    int rc, is_ss;
+    if(len < 2) return -1;
+    if(!known_ae(message[2])) {
+        debugf("Received request with unknown AE %d. Ignoring.\n",
+               message[2]);
+        return 0;
+    }
+    rc = network_prefix(message[2], message[3], 0,
+                        message + 4, NULL, len - 2, prefix);
+    if(rc < 0) return -1;
+    plen = message[3] + (message[2] == 1 ? 96 : 0);
+    if(message[2] == 1) {
+        v4tov6(src_prefix, zeroes);
+        src_plen = 96;
+    } else {
+        memcpy(src_prefix, zeroes, 16);
+        src_plen = 0;
+    }
+    rc = parse_request_subtlv(message[2], message + 4 + rc,
+                              len - 2 - rc, src_prefix, &src_plen);
+    if(rc < 0)
+        return 0;
+    is_ss = !is_default(src_prefix, src_plen);
+    if(message[2] == 0) {
+        if(is_ss) {
+            /* Wildcard requests don't carry a source prefix. */
+            fprintf(stderr,
+                    "Received source-specific wildcard request.\n");
+            return 0;
+        }
+        debugf("Received request for any from %s on %s.\n",
+               format_address(s->from), s->ifp->name);
+        /* If a neighbour is requesting a full route dump from us,
+           we might as well send it an IHU. */
+        send_ihu(neigh, NULL);
+        /* Since nodes send wildcard requests on boot, booting
+           a large number of nodes at the same time may cause an
+           update storm.  Ignore a wildcard request that happens
+           shortly after we sent a full update. */
+        if(neigh->ifp->last_update_time <
+           now.tv_sec - MAX(neigh->ifp->hello_interval / 100, 1)) {
+            send_update(neigh->ifp, 0, NULL, 0, NULL, 0);
+        }
+    } else {
+        debugf("Received request for dst %s%s%s from %s on %s.\n",
+               format_prefix(prefix, plen),
+               is_ss ? " src " : "",
+               is_ss ? format_prefix(src_prefix, src_plen) : "",
+               format_address(s->from), s->ifp->name);
+        send_update(neigh->ifp, 0, prefix, plen, src_prefix, src_plen);
+    }
+    return 0;
+}
+
+static int
+parse_mh_request_tlv(struct parse_state *s, const unsigned char *message,
+                     int len)
+{
+    unsigned char prefix[16], src_prefix[16], plen, src_plen;
+    unsigned short seqno;
+    int rc, is_ss;
+    if(len < 14) return -1;
+    if(!known_ae(message[2])) {
+        debugf("Received mh_request with unknown AE %d. Ignoring.\n",
+               message[2]);
+        return 0;
     }
+    DO_NTOHS(seqno, message + 4);
+    rc = network_prefix(message[2], message[3], 0,
+                        message + 16, NULL, len - 14, prefix);
+    if(rc < 0) return -1;
+    if(message[2] == 1) {
+        v4tov6(src_prefix, zeroes);
+        src_plen = 96;
+    } else {
+        memcpy(src_prefix, zeroes, 16);
+        src_plen = 0;
+    }
+    rc = parse_seqno_request_subtlv(message[2], message + 16 + rc,
+                                    len - 14 - rc, src_prefix,
+                                    &src_plen);
+    if(rc < 0)
+        return 0;
+    is_ss = !is_default(src_prefix, src_plen);
+    plen = message[3] + (message[2] == 1 ? 96 : 0);
+    debugf("Received request (%d) for dst %s%s%s from %s on "
+           "%s (%s, %d).\n",
+           message[6],
+           format_prefix(prefix, plen),
+           is_ss ? " src " : "",
+           is_ss ? format_prefix(src_prefix, src_plen) : "",
+           format_address(s->from), s->ifp->name,
+           format_eui64(message + 8), seqno);
+    handle_request(s->neigh, prefix, plen, src_prefix, src_plen,
+                   message[6], seqno, message + 8);
+    return 0;
+}
+
+static int (* const tlv_parsers[])(struct parse_state *,
+                                   const unsigned char *, int) = {
+    [MESSAGE_ACK_REQ] = parse_ack_req_tlv,
+    [MESSAGE_ACK] = parse_ack_tlv,
+    [MESSAGE_HELLO] = parse_hello_tlv,
+    [MESSAGE_IHU] = parse_ihu_tlv,
+    [MESSAGE_ROUTER_ID] = parse_router_id_tlv,
+    [MESSAGE_NH] = parse_nh_tlv,
+    [MESSAGE_UPDATE] = parse_update_tlv,
+    [MESSAGE_REQUEST] = parse_request_tlv,
+    [MESSAGE_MH_REQUEST] = parse_mh_request_tlv,
+};
+
+#define NUM_TLV_PARSERS (sizeof(tlv_parsers) / sizeof(tlv_parsers[0]))
+
+/* Splits a packet body into TLVs, starting at *pos and skipping padding.
+   Stores at most max descriptors, advances *pos past them and returns
+   their number.  A truncated TLV ends the body. */
+int
+index_tlvs(const unsigned char *body, int bodylen, int *pos,
+           struct tlv *tlvs, int max)
+{
+    int i = *pos, n = 0, len;
+
+    while(i < bodylen && n < max) {
+        if(body[i] == MESSAGE_PAD1) {
+            i++;
+            continue;
+        }
+        if(i + 2 > bodylen || i + 2 + (len = body[i + 1]) > bodylen) {
+            fprintf(stderr, "Received truncated message.\n");
+            i = bodylen;
+            break;
+        }
+        if(body[i] != MESSAGE_PADN) {
+            tlvs[n].type = body[i];
+            tlvs[n].len = len;
+            tlvs[n].offset = i;
+            n++;
+        }
+        i += len + 2;
+    }
+    *pos = i;
+    return n;
+}
+
+void
+parse_packet(const unsigned char *from, struct interface *ifp,
+             const unsigned char *packet, int packetlen)
+{
+    const unsigned char *body = packet + 4;
+    struct tlv tlvs[TLV_BATCH];
+    struct parse_state s;
+    struct neighbour *neigh;
+    int bodylen, pos, n, j;
 
     if(!linklocal(from)) {
         fprintf(stderr, "Received packet from non-local address %s.\n",
@@ -501,400 +950,44 @@ parse_packet(const unsigned char *from, struct interface *ifp,
         return;
     }
 
-    i = 0;
-    while(i < bodylen) {
-        message = packet + 4 + i;
-        type = message[0];
-        if(type == MESSAGE_PAD1) {
-            debugf("Received pad1 from %s on %s.\n",
-                   format_address(from), ifp->name);
-            i++;
-            continue;
-        }
-        if(i + 2 > bodylen) {
-            fprintf(stderr, "Received truncated message.\n");
-            break;
-        }
-        len = message[1];
-        if(i + len + 2 > bodylen) {
-            fprintf(stderr, "Received truncated message.\n");
-            break;
-        }
-
-        if(type == MESSAGE_PADN) {
-            debugf("Received pad%d from %s on %s.\n",
-                   len, format_address(from), ifp->name);
-        } else if(type == MESSAGE_ACK_REQ) {
-            unsigned short nonce, interval;
-            int rc;
-            if(len < 6) goto fail;
-            DO_NTOHS(nonce, message + 4);
-            DO_NTOHS(interval, message + 6);
-            debugf("Received ack-req (%04X %d) from %s on %s.\n",
-                   nonce, interval, format_address(from), ifp->name);
-            rc = parse_other_subtlv(message + 8, len - 6);
-            if(rc < 0)
-                goto done;
-            send_ack(neigh, nonce, interval);
-        } else if(type == MESSAGE_ACK) {
-            int rc;
-            debugf("Received ack from %s on %s.\n",
-                   format_address(from), ifp->name);
-            rc = parse_other_subtlv(message + 4, len - 2);
-            if(rc < 0)
-                goto done;
-            /* Nothing right now */
-        } else if(type == MESSAGE_HELLO) {
-            unsigned short seqno, interval;
-            int unicast, changed, have_timestamp, rc;
-            unsigned int timestamp;
-            if(len < 6) goto fail;
-            unicast = !!(message[2] & 0x80);
-            DO_NTOHS(seqno, message + 4);
-            DO_NTOHS(interval, message + 6);
-            debugf("Received hello %d (%d) from %s on %s.\n",
-                   seqno, interval,
-                   format_address(from), ifp->name);
-            /* Sub-TLV handling. */
-            rc = parse_hello_subtlv(message + 8, len - 6,
-                                    &timestamp, &have_timestamp);
-            if(rc < 0)
-                goto done;
-            changed =
-                update_neighbour(neigh,
-                                 unicast ? &neigh->uhello : &neigh->hello,
-                                 unicast, seqno, interval);
-            update_neighbour_metric(neigh, changed);
-            if(interval > 0)
-                /* Multiply by 3/2 to allow hellos to expire. */
-                schedule_neighbours_check(interval * 15, 0);
-            if(have_timestamp) {
-                neigh->hello_send_us = timestamp;
-                neigh->hello_rtt_receive_time = now;
-                have_hello_rtt = 1;
-            }
-        } else if(type == MESSAGE_IHU) {
-            unsigned short txcost, interval;
-            unsigned char address[16];
-            int rc;
-            if(len < 6) goto fail;
-            if(!known_ae(message[2])) {
-                debugf("Received IHU with unknown AE %d. Ignoring.\n",
-                       message[2]);
-                goto done;
-            }
-            DO_NTOHS(txcost, message + 4);
-            DO_NTOHS(interval, message + 6);
-            rc = network_address(message[2], message + 8, len - 6, address);
-            if(rc < 0) goto fail;
-            debugf("Received ihu %d (%d) from %s on %s for %s.\n",
-                   txcost, interval,
-                   format_address(from), ifp->name,
-                   format_address(address));
-            if(message[2] == 0 || interface_ll_address(ifp, address)) {
-                int changed;
-                rc = parse_ihu_subtlv(message + 8 + rc, len - 6 - rc,
-                                      &hello_send_us, &hello_rtt_receive_time,
-                                      NULL);
-                if(rc < 0)
-                    goto done;
-                changed = txcost != neigh->txcost;
-                neigh->txcost = txcost;
-                neigh->ihu_time = now;
-                neigh->ihu_interval = interval;
-                update_neighbour_metric(neigh, changed);
-                if(interval > 0)
-                    /* Multiply by 3/2 to allow neighbours to expire. */
-                    schedule_neighbours_check(interval * 45, 0);
-            }
-        } else if(type == MESSAGE_ROUTER_ID) {
-            int rc;
-            if(len < 10) {
-                have_router_id = 0;
-                goto fail;
-            }
-            memcpy(router_id, message + 4, 8);
-            have_router_id = 1;
-            debugf("Received router-id %s from %s on %s.\n",
-                   format_eui64(router_id), format_address(from), ifp->name);
-            rc = parse_other_subtlv(message + 12, len - 10);
-            if(rc < 0)
-                goto done;
-        } else if(type == MESSAGE_NH) {
-            unsigned char nh[16];
+    s.from = from;
+    s.ifp = ifp;
+    s.neigh = neigh;
+    s.have_router_id = s.have_v4_prefix = s.have_v6_prefix = 0;
+    s.have_v4_nh = s.have_v6_nh = 0;
+    s.have_hello_rtt = 0;
+    s.hello_send_us = s.hello_rtt_receive_time = 0;
+
+    pos = 0;
+    while(pos < bodylen) {
+        n = index_tlvs(body, bodylen, &pos, tlvs, TLV_BATCH);
+        for(j = 0; j < n; j++) {
+            const unsigned char *message = body + tlvs[j].offset;
             int rc;
-            if(len < 2) {
-                have_v4_nh = 0;
-                have_v6_nh = 0;
-                goto fail;
-            }
-            rc = network_address(message[2], message + 4, len - 2, nh);
-            if(!known_ae(message[2])) {
-                debugf("Received NH with unknown AE %d. Ignoring.\n",
-                       message[2]);
-                goto done;
-            }
-            if(message[2] == 0) {
-                debugf("Received NH with bad AE 0. Error.\n");
-                goto fail;
-            }
-            if(rc < 0) {
-                have_v4_nh = 0;
-                have_v6_nh = 0;
-                goto fail;
-            }
-            debugf("Received nh %s (%d) from %s on %s.\n",
-                   format_address(nh), message[2],
-                   format_address(from), ifp->name);
-            if(message[2] == 1) {
-                memcpy(v4_nh, nh, 16);
-                have_v4_nh = 1;
-            } else {
-                memcpy(v6_nh, nh, 16);
-                have_v6_nh = 1;
-            }
-            rc = parse_other_subtlv(message + 4 + rc, len - 2 - rc);
-            if(rc < 0)
-                goto done;
-        } else if(type == MESSAGE_UPDATE) {
-            unsigned char prefix[16], src_prefix[16], *nh;
-            unsigned char plen, src_plen;
-            unsigned char channels[MAX_CHANNEL_HOPS];
-            int channels_len = MAX_CHANNEL_HOPS;
-            unsigned short interval, seqno, metric;
-            int rc, parsed_len, is_ss;
-            if(len < 10) {
-                if(len < 2 || message[3] & 0x80)
-                    have_v4_prefix = have_v6_prefix = 0;
-                goto fail;
-            }
-            if(!known_ae(message[2])) {
-                debugf("Received update with unknown AE %d. Ignoring.\n",
-                       message[2]);
-                goto done;
-            }
-            DO_NTOHS(interval, message + 6);
-            DO_NTOHS(seqno, message + 8);
-            DO_NTOHS(metric, message + 10);
-            if(message[5] == 0 ||
-               (message[2] == 1 ? have_v4_prefix : have_v6_prefix))
-                rc = network_prefix(message[2], message[4], message[5],
-                                    message + 12,
-                                    message[2] == 1 ? v4_prefix : v6_prefix,
-                                    len - 10, prefix);
-            else
-                rc = -1;
-            if(message[2] == 1) {
-                v4tov6(src_prefix, zeroes);
-                src_plen = 96;
-            } else {
-                memcpy(src_prefix, zeroes, 16);
-                src_plen = 0;
-            }
-            if(rc < 0) {
-                if(message[3] & 0x80)
-                    have_v4_prefix = have_v6_prefix = 0;
-                goto fail;
-            }
-            parsed_len = 10 + rc;
-
-            plen = message[4] + (message[2] == 1 ? 96 : 0);
-
-            if(message[3] & 0x80) {
-                if(message[2] == 1) {
-                    memcpy(v4_prefix, prefix, 16);
-                    have_v4_prefix = 1;
-                } else {
-                    memcpy(v6_prefix, prefix, 16);
-                    have_v6_prefix = 1;
-                }
-            }
-            if(message[3] & 0x40) {
-                if(message[2] == 1) {
-                    memset(router_id, 0, 4);
-                    memcpy(router_id + 4, prefix + 12, 4);
-                } else {
-                    memcpy(router_id, prefix + 8, 8);
-                }
-                have_router_id = 1;
-            }
-            if(metric < INFINITY && !have_router_id && message[2] != 0) {
-                fprintf(stderr, "Received prefix with no router id.\n");
-                goto fail;
-            }
-            debugf("Received update%s%s for %s from %s on %s.\n",
-                   (message[3] & 0x80) ? "/prefix" : "",
-                   (message[3] & 0x40) ? "/id" : "",
-                   format_prefix(prefix, plen),
-                   format_address(from), ifp->name);
-            if(message[2] == 1) {
-                if(have_v4_nh) {
-                    nh = v4_nh;
-                } else {
-                    if(metric < INFINITY)
-                        goto fail;
-                    nh = NULL;
-                }
-            } else if(have_v6_nh) {
-                nh = v6_nh;
-            } else {
-                nh = neigh->address;
-            }
-
-            rc = parse_update_subtlv(ifp, metric, message[2],
-                                     message + 2 + parsed_len,
-                                     len - parsed_len, channels, &channels_len,
-                                     src_prefix, &src_plen);
-            if(rc < 0)
-                goto done;
-
-            if(message[2] == 0) {
-                if(metric < 0xFFFF) {
-                    fprintf(stderr,
-                            "Received wildcard update with finite metric.\n");
-                    goto done;
-                }
-                if(src_plen > 0) {
-                    fprintf(stderr,
-                            "Received wildcard update with source prefix.\n");
-                    goto done;
-                }
-                retract_neighbour_routes(neigh);
-                goto done;
-            }
-
-            is_ss = !is_default(src_prefix, src_plen);
-            debugf("Received update%s%s for dst %s%s%s from %s on %s.\n",
-                   (message[3] & 0x80) ? "/prefix" : "",
-                   (message[3] & 0x40) ? "/id" : "",
-                   format_prefix(prefix, plen),
-                   is_ss ? " src " : "",
-                   is_ss ? format_prefix(src_prefix, src_plen) : "",
-                   format_address(from), ifp->name);
-
-            if(message[2] == 1) {
-                if(!ifp->ipv4)
-                    goto done;
-            }
-
-            update_route(have_router_id ? router_id : NULL,
-                         prefix, plen, src_prefix, src_plen, seqno,
-                         metric, interval, neigh, nh,
-                         channels, channels_len);
-        } else if(type == MESSAGE_REQUEST) {
-            unsigned char prefix[16], src_prefix[16], plen, src_plen;
-            int rc, is_ss;
-            if(len < 2) goto fail;
-            if(!known_ae(message[2])) {
-                debugf("Received request with unknown AE %d. Ignoring.\n",
-                       message[2]);
-                goto done;
-            }
-            rc = network_prefix(message[2], message[3], 0,
-                                message + 4, NULL, len - 2, prefix);
-            if(rc < 0) goto fail;
-            plen = message[3] + (message[2] == 1 ? 96 : 0);
-            if(message[2] == 1) {
-                v4tov6(src_prefix, zeroes);
-                src_plen = 96;
-            } else {
-                memcpy(src_prefix, zeroes, 16);
-                src_plen = 0;
-            }
-            rc = parse_request_subtlv(message[2], message + 4 + rc,
-                                      len - 2 - rc, src_prefix, &src_plen);
-            if(rc < 0)
-                goto done;
-            is_ss = !is_default(src_prefix, src_plen);
-            if(message[2] == 0) {
-                if(is_ss) {
-                    /* Wildcard requests don't carry a source prefix. */
-                    fprintf(stderr,
-                            "Received source-specific wildcard request.\n");
-                    goto done;
-                }
-                debugf("Received request for any from %s on %s.\n",
-                       format_address(from), ifp->name);
-                /* If a neighbour is requesting a full route dump from us,
-                   we might as well send it an IHU. */
-                send_ihu(neigh, NULL);
-                /* Since nodes send wildcard requests on boot, booting
-                   a large number of nodes at the same time may cause an
-                   update storm.  Ignore a wildcard request that happens
-                   shortly after we sent a full update. */
-                if(neigh->ifp->last_update_time <
-                   now.tv_sec - MAX(neigh->ifp->hello_interval / 100, 1)) {
-                    send_update(neigh->ifp, 0, NULL, 0, NULL, 0);
-                }
-            } else {
-                debugf("Received request for dst %s%s%s from %s on %s.\n",
-                       message[2] == 0 ? "" : format_prefix(prefix, plen),
-                       is_ss ? " src " : "",
-                       is_ss ? format_prefix(src_prefix, src_plen) : "",
-                       format_address(from), ifp->name);
-                send_update(neigh->ifp, 0, prefix, plen, src_prefix, src_plen);
-            }
-        } else if(type == MESSAGE_MH_REQUEST) {
-            unsigned char prefix[16], src_prefix[16], plen, src_plen;
-            unsigned short seqno;
-            int rc, is_ss;
-            if(len < 14) goto fail;
-            if(!known_ae(message[2])) {
-                debugf("Received mh_request with unknown AE %d. Ignoring.\n",
-                       message[2]);
-                goto done;
-            }
-            DO_NTOHS(seqno, message + 4);
-            rc = network_prefix(message[2], message[3], 0,
-                                message + 16, NULL, len - 14, prefix);
-            if(rc < 0) goto fail;
-            if(message[2] == 1) {
-                v4tov6(src_prefix, zeroes);
-                src_plen = 96;
-            } else {
-                memcpy(src_prefix, zeroes, 16);
-                src_plen = 0;
+            if(tlvs[j].type >= NUM_TLV_PARSERS ||
+               tlv_parsers[tlvs[j].type] == NULL) {
+                debugf("Received unknown packet type %d from %s on %s.\n",
+                       tlvs[j].type, format_address(from), ifp->name);
+                continue;
             }
-            rc = parse_seqno_request_subtlv(message[2], message + 16 + rc,
-                                            len - 14 - rc, src_prefix,
-                                            &src_plen);
+            rc = tlv_parsers[tlvs[j].type](&s, message, tlvs[j].len);
             if(rc < 0)
-                goto done;
-            is_ss = !is_default(src_prefix, src_plen);
-            plen = message[3] + (message[2] == 1 ? 96 : 0);
-            debugf("Received request (%d) for dst %s%s%s from %s on "
-                   "%s (%s, %d).\n",
-                   message[6],
-                   format_prefix(prefix, plen),
-                   is_ss ? " src " : "",
-                   is_ss ? format_prefix(src_prefix, src_plen) : "",
-                   format_address(from), ifp->name,
-                   format_eui64(message + 8), seqno);
-            handle_request(neigh, prefix, plen, src_prefix, src_plen,
-                           message[6], seqno, message + 8);
-        } else {
-            debugf("Received unknown packet type %d from %s on %s.\n",
-                   type, format_address(from), ifp->name);
+                fprintf(stderr,
+                        "Couldn't parse packet (%d, %d) from %s on %s.\n",
+                        message[0], message[1],
+                        format_address(from), ifp->name);
         }
-    done:
-        i += len + 2;
-        continue;
-
-    fail:
-        fprintf(stderr, "Couldn't parse packet (%d, %d) from %s on %s.\n",
-                message[0], message[1], format_address(from), ifp->name);
-        goto done;
     }
 
     /* We can calculate the RTT to this neighbour. */
-    if(have_hello_rtt && hello_send_us && hello_rtt_receive_time) {
+    if(s.have_hello_rtt && s.hello_send_us && s.hello_rtt_receive_time) {
         int remote_waiting_us, local_waiting_us;
         unsigned int rtt, smoothed_rtt;
         unsigned int old_rttcost;
         int changed = 0;
-        remote_waiting_us = neigh->hello_send_us - hello_rtt_receive_time;
+        remote_waiting_us = neigh->hello_send_us - s.hello_rtt_receive_time;
         local_waiting_us = time_us(neigh->hello_rtt_receive_time) -
-            hello_send_us;
+            s.hello_send_us;
 
         /* Sanity checks (validity window of 10 minutes). */
         if(remote_waiting_us < 0 || local_waiting_us < 0 ||
@@ -960,12 +1053,10 @@ flushbuf(struct buffered *buf, struct interface *ifp)
         debugf("  (flushing %d buffered bytes)\n", buf->len);
         DO_HTONS(packet_header + 2, buf->len);
         fill_rtt_message(buf, ifp);
-        rc = babel_send(protocol_socket,
-                        packet_header, sizeof(packet_header),
-                        buf->buf, buf->len,
-                        (struct sockaddr*)&buf->sin6,
-                        sizeof(buf->sin6));
-        if(rc < 0)
+        rc = babel_queue(protocol_socket,
+                         packet_header, sizeof(packet_header),
+                         buf->buf, buf->len, &buf->sin6);
+        if(rc < 0 && errno != ENOBUFS)
             perror("send");
     }
     VALGRIND_MAKE_MEM_UNDEFINED(buf->buf, buf->size);
@@ -973,18 +1064,17 @@ flushbuf(struct buffered *buf, struct interface *ifp)
     buf->hello = -1;
     buf->have_id = 0;
     buf->have_nh = 0;
-    buf->have_prefix = 0;
-    buf->timeout.tv_sec = 0;
-    buf->timeout.tv_usec = 0;
+    buf->have_prefix[0] = buf->have_prefix[1] = 0;
+    timer_cancel(&buf->timer);
 }
 
 static void
 schedule_flush_ms(struct buffered *buf, int msecs)
 {
-    if(buf->timeout.tv_sec != 0 &&
-       timeval_minus_msec(&buf->timeout, &now) < msecs)
+    if(timer_armed(&buf->timer) &&
+       timeval_minus_msec(&buf->timer.time, &now) < msecs)
         return;
-    set_timeout(&buf->timeout, msecs);
+    set_timeout(&buf->timer, msecs);
 }
 
 static void
@@ -1107,7 +1197,7 @@ send_multicast_hello(struct interface *ifp, unsigned interval, int force)
 
     ifp->hello_seqno = seqno_plus(ifp->hello_seqno, 1);
     if(interval > 0)
-        set_timeout(&ifp->hello_timeout, ifp->hello_interval);
+        set_timeout(&ifp->hello_timer, ifp->hello_interval);
 
     debugf("Sending hello %d (%d) to %s.\n",
            ifp->hello_seqno, interval, ifp->name);
@@ -1160,9 +1250,11 @@ really_buffer_update(struct buffered *buf, struct interface *ifp,
                      unsigned char *channels, int channels_len)
 {
     int add_metric, v4, real_plen, real_src_plen;
-    int omit, spb, channels_size, len;
+    int omit, pb, spb, channels_size, len;
+    int need_nh, need_id, new_id, flushed;
     const unsigned char *real_prefix, *real_src_prefix;
-    unsigned short flags = 0;
+    unsigned char *p, *start;
+    unsigned short flags;
     int is_ss = !is_default(src_prefix, src_plen);
 
     if(!if_up(ifp))
@@ -1178,91 +1270,123 @@ really_buffer_update(struct buffered *buf, struct interface *ifp,
 
     metric = MIN(metric + add_metric, INFINITY);
 
-    /* Worst case */
-    ensure_space(buf, ifp, 20 + 12 + 28 + 18);
-
     v4 = plen >= 96 && v4mapped(prefix);
-
     if(v4) {
         if(!ifp->ipv4)
             return;
-        omit = 0;
-        if(!buf->have_nh ||
-           memcmp(buf->nh, ifp->ipv4, 4) != 0) {
-            start_message(buf, ifp, MESSAGE_NH, 6);
-            accumulate_byte(buf, 1);
-            accumulate_byte(buf, 0);
-            accumulate_bytes(buf, ifp->ipv4, 4);
-            end_message(buf, MESSAGE_NH, 6);
-            memcpy(&buf->nh, ifp->ipv4, 4);
-            buf->have_nh = 1;
-        }
         real_prefix = prefix + 12;
         real_plen = plen - 96;
         real_src_prefix = src_prefix + 12;
         real_src_plen = src_plen - 96;
     } else {
-        omit = 0;
-        if(buf->have_prefix) {
-            while(omit < plen / 8 &&
-                  buf->prefix[omit] == prefix[omit])
-                omit++;
-        }
-        if(!buf->have_prefix || plen >= 48)
-            flags |= 0x80;
         real_prefix = prefix;
         real_plen = plen;
         real_src_prefix = src_prefix;
         real_src_plen = src_plen;
     }
+    pb = (real_plen + 7) / 8;
+    spb = (real_src_plen + 7) / 8;
+    channels_size = diversity_kind == DIVERSITY_CHANNEL && channels_len >= 0 ?
+        channels_len + 2 : 0;
 
-    if(!buf->have_id || memcmp(id, buf->id, 8) != 0) {
-        if(real_plen == 128 && memcmp(real_prefix + 8, id, 8) == 0) {
+    /* Compute the size of everything we are about to write, so that the
+       buffer is only checked once.  Flushing resets the compression
+       state, so recompute it if we had to. */
+    flushed = 0;
+ again:
+    flags = 0;
+    omit = 0;
+    need_nh = v4 && (!buf->have_nh || memcmp(buf->nh, ifp->ipv4, 4) != 0);
+    if(buf->have_prefix[v4]) {
+        while(omit < real_plen / 8 &&
+              buf->prefix[v4][omit] == real_prefix[omit])
+            omit++;
+    }
+    /* Don't replace the default prefix with one that is too short to
+       be shared with the following updates. */
+    if(!buf->have_prefix[v4] || real_plen >= (v4 ? 16 : 48))
+        flags |= 0x80;
+    new_id = !buf->have_id || memcmp(id, buf->id, 8) != 0;
+    need_id = 0;
+    if(new_id) {
+        if(real_plen == 128 && memcmp(real_prefix + 8, id, 8) == 0)
             flags |= 0x40;
-        } else {
-            start_message(buf, ifp, MESSAGE_ROUTER_ID, 10);
-            accumulate_short(buf, 0);
-            accumulate_bytes(buf, id, 8);
-            end_message(buf, MESSAGE_ROUTER_ID, 10);
-        }
-        memcpy(buf->id, id, 8);
-        buf->have_id = 1;
+        else
+            need_id = 1;
     }
 
-    channels_size = diversity_kind == DIVERSITY_CHANNEL && channels_len >= 0 ?
-        channels_len + 2 : 0;
-    len = 10 + (real_plen + 7) / 8 - omit + channels_size;
-    spb = (real_src_plen + 7) / 8;
+    len = 10 + pb - omit + channels_size;
     if(is_ss)
         len += 3 + spb;
 
-    start_message(buf, ifp, MESSAGE_UPDATE, len);
-    accumulate_byte(buf, v4 ? 1 : 2);
-    accumulate_byte(buf, flags);
-    accumulate_byte(buf, real_plen);
-    accumulate_byte(buf, omit);
-    accumulate_short(buf, (ifp->update_interval + 5) / 10);
-    accumulate_short(buf, seqno);
-    accumulate_short(buf, metric);
-    accumulate_bytes(buf, real_prefix + omit, (real_plen + 7) / 8 - omit);
+    if(buf->size - buf->len <
+       (need_nh ? 8 : 0) + (need_id ? 12 : 0) + 2 + len && !flushed) {
+        flushbuf(buf, ifp);
+        flushed = 1;
+        goto again;
+    }
+
+    p = start = buf->buf + buf->len;
+    if(need_nh) {
+        p[0] = MESSAGE_NH;
+        p[1] = 6;
+        p[2] = 1;
+        p[3] = 0;
+        memcpy(p + 4, ifp->ipv4, 4);
+        p += 8;
+        memcpy(buf->nh, ifp->ipv4, 4);
+        buf->have_nh = 1;
+    }
+    if(need_id) {
+        p[0] = MESSAGE_ROUTER_ID;
+        p[1] = 10;
+        p[2] = 0;
+        p[3] = 0;
+        memcpy(p + 4, id, 8);
+        p += 12;
+    }
+    if(new_id) {
+        memcpy(buf->id, id, 8);
+        buf->have_id = 1;
+    }
+
+    p[0] = MESSAGE_UPDATE;
+    p[1] = len;
+    p[2] = v4 ? 1 : 2;
+    p[3] = flags;
+    p[4] = real_plen;
+    p[5] = omit;
+    DO_HTONS(p + 6, (ifp->update_interval + 5) / 10);
+    DO_HTONS(p + 8, seqno);
+    DO_HTONS(p + 10, metric);
+    memcpy(p + 12, real_prefix + omit, pb - omit);
+    p += 12 + pb - omit;
     if(is_ss) {
-        accumulate_byte(buf, SUBTLV_SOURCE_PREFIX);
-        accumulate_byte(buf, 1 + spb);
-        accumulate_byte(buf, real_src_plen);
-        accumulate_bytes(buf, real_src_prefix, spb);
+        p[0] = SUBTLV_SOURCE_PREFIX;
+        p[1] = 1 + spb;
+        p[2] = real_src_plen;
+        memcpy(p + 3, real_src_prefix, spb);
+        p += 3 + spb;
     }
     /* Note that an empty channels TLV is different from no such TLV. */
     if(channels_size > 0) {
-        accumulate_byte(buf, 2);
-        accumulate_byte(buf, channels_len);
+        p[0] = 2;
+        p[1] = channels_len;
         if(channels_len > 0)
-            accumulate_bytes(buf, channels, channels_len);
+            memcpy(p + 2, channels, channels_len);
+        p += 2 + channels_len;
     }
-    end_message(buf, MESSAGE_UPDATE, len);
+    buf->len = p - buf->buf;
+    assert(buf->len <= buf->size);
+    schedule_flush(buf);
+
     if(flags & 0x80) {
-        memcpy(buf->prefix, prefix, 16);
-        buf->have_prefix = 1;
+        memcpy(buf->prefix[v4], real_prefix, v4 ? 4 : 16);
+        buf->have_prefix[v4] = 1;
     }
+
+    updates_sent++;
+    update_bytes_sent += p - start;
 }
 
 static void
@@ -1277,12 +1401,10 @@ really_send_update(struct interface *ifp, const unsigned char *id,
 
     if((ifp->flags & IF_UNICAST) != 0) {
         struct neighbour *neigh;
-        FOR_ALL_NEIGHBOURS(neigh) {
-            if(neigh->ifp == ifp) {
-                really_buffer_update(&neigh->buf, ifp, id,
-                                     prefix, plen, src_prefix, src_plen,
-                                     seqno, metric, channels, channels_len);
-            }
+        FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+            really_buffer_update(&neigh->buf, ifp, id,
+                                 prefix, plen, src_prefix, src_plen,
+                                 seqno, metric, channels, channels_len);
         }
     } else {
         really_buffer_update(&ifp->buf, ifp, id,
@@ -1291,59 +1413,315 @@ really_send_update(struct interface *ifp, const unsigned char *id,
     }
 }
 
+static unsigned int
+update_hash(const unsigned char *prefix, unsigned char plen,
+            const unsigned char *src_prefix, unsigned char src_plen)
+{
+    unsigned int h = HASH_INIT;
+    h = hash_bytes(h, prefix, 16);
+    h = hash_bytes(h, &plen, 1);
+    h = hash_bytes(h, src_prefix, 16);
+    h = hash_bytes(h, &src_plen, 1);
+    return h;
+}
+
+/* Returns the position in q->update_hash of the given update, or of the
+   free slot where it would go. */
 static int
-compare_buffered_updates(const void *av, const void *bv)
+find_update_slot(struct update_queue *q,
+                 const unsigned char *prefix, unsigned char plen,
+                 const unsigned char *src_prefix, unsigned char src_plen)
 {
-    const struct buffered_update *a = av, *b = bv;
-    int rc, v4a, v4b, ma, mb;
+    int mask = 2 * q->max_updates - 1;
+    int i = update_hash(prefix, plen, src_prefix, src_plen) & mask;
+
+    while(q->update_hash[i] >= 0) {
+        struct buffered_update *b = &q->updates[q->update_hash[i]];
+        if(b->plen == plen && b->src_plen == src_plen &&
+           memcmp(b->prefix, prefix, 16) == 0 &&
+           memcmp(b->src_prefix, src_prefix, 16) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
 
-    rc = memcmp(a->id, b->id, 8);
-    if(rc != 0)
-        return rc;
+static int
+find_group_slot(struct update_queue *q, const unsigned char *id)
+{
+    int mask = 2 * q->max_groups - 1;
+    int i = hash_bytes(HASH_INIT, id, 8) & mask;
 
-    v4a = (a->plen >= 96 && v4mapped(a->prefix));
-    v4b = (b->plen >= 96 && v4mapped(b->prefix));
+    while(q->group_hash[i] >= 0) {
+        if(memcmp(q->groups[q->group_hash[i]].id, id, 8) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
 
-    if(v4a > v4b)
-        return 1;
-    else if(v4a < v4b)
-        return -1;
+static int *
+alloc_hash(int n)
+{
+    int *hash = malloc(n * sizeof(int));
+    if(hash != NULL)
+        memset(hash, 0xFF, n * sizeof(int));
+    return hash;
+}
 
-    ma = (!v4a && a->plen == 128 && memcmp(a->prefix + 8, a->id, 8) == 0);
-    mb = (!v4b && b->plen == 128 && memcmp(b->prefix + 8, b->id, 8) == 0);
+/* Double the capacity of the queue, rehashing existing entries. */
+static int
+grow_updates(struct update_queue *q)
+{
+    int n = q->max_updates < 1 ? 64 : 2 * q->max_updates;
+    struct buffered_update *updates;
+    int *hash, i;
 
-    if(ma > mb)
+    hash = alloc_hash(2 * n);
+    if(hash == NULL)
+        return -1;
+    updates = realloc(q->updates, n * sizeof(struct buffered_update));
+    if(updates == NULL) {
+        free(hash);
         return -1;
-    else if(mb > ma)
-        return 1;
+    }
+    free(q->update_hash);
+    q->updates = updates;
+    q->update_hash = hash;
+    q->max_updates = n;
+    for(i = 0; i < q->num_updates; i++) {
+        struct buffered_update *b = &q->updates[i];
+        b->slot = find_update_slot(q, b->prefix, b->plen,
+                                   b->src_prefix, b->src_plen);
+        q->update_hash[b->slot] = i;
+    }
+    return 1;
+}
+
+static int
+grow_groups(struct update_queue *q)
+{
+    int n = q->max_groups < 1 ? 8 : 2 * q->max_groups;
+    struct update_group *groups;
+    int *hash, i;
 
-    if(a->plen < b->plen)
-        return 1;
-    else if(a->plen > b->plen)
+    hash = alloc_hash(2 * n);
+    if(hash == NULL)
         return -1;
+    groups = realloc(q->groups, n * sizeof(struct update_group));
+    if(groups == NULL) {
+        free(hash);
+        return -1;
+    }
+    free(q->group_hash);
+    q->groups = groups;
+    q->group_hash = hash;
+    q->max_groups = n;
+    for(i = 0; i < q->num_groups; i++) {
+        q->groups[i].slot = find_group_slot(q, q->groups[i].id);
+        q->group_hash[q->groups[i].slot] = i;
+    }
+    return 1;
+}
+
+/* Order of updates within a group.  A router's own /128 goes first, so
+   that the router-id can be derived from it; the rest is sorted by
+   prefix, which maximises the bytes shared by consecutive updates. */
+static int
+compare_buffered_updates(const struct buffered_update *a,
+                         const struct buffered_update *b)
+{
+    int rc, ma, mb;
+
+    ma = a->plen == 128 && memcmp(a->prefix + 8, a->id, 8) == 0;
+    mb = b->plen == 128 && memcmp(b->prefix + 8, b->id, 8) == 0;
+    if(ma != mb)
+        return mb - ma;
 
     rc = memcmp(a->prefix, b->prefix, 16);
     if(rc != 0)
         return rc;
+    if(a->plen != b->plen)
+        return a->plen - b->plen;
+    if(a->src_plen != b->src_plen)
+        return a->src_plen - b->src_plen;
+    return memcmp(a->src_prefix, b->src_prefix, 16);
+}
 
-    if(a->src_plen < b->src_plen)
-        return -1;
-    else if(a->src_plen > b->src_plen)
-        return 1;
+/* Merge sort of a list linked through the next field. */
+static int
+sort_update_list(struct update_queue *q, int head)
+{
+    int slow, fast, other, result, *tail;
 
-    return memcmp(a->src_prefix, b->src_prefix, 16);
+    if(head < 0 || q->updates[head].next < 0)
+        return head;
+
+    slow = head;
+    fast = q->updates[head].next;
+    while(fast >= 0 && q->updates[fast].next >= 0) {
+        slow = q->updates[slow].next;
+        fast = q->updates[q->updates[fast].next].next;
+    }
+    other = q->updates[slow].next;
+    q->updates[slow].next = -1;
+
+    head = sort_update_list(q, head);
+    other = sort_update_list(q, other);
+
+    tail = &result;
+    while(head >= 0 && other >= 0) {
+        if(compare_buffered_updates(&q->updates[head],
+                                    &q->updates[other]) <= 0) {
+            *tail = head;
+            tail = &q->updates[head].next;
+            head = *tail;
+        } else {
+            *tail = other;
+            tail = &q->updates[other].next;
+            other = *tail;
+        }
+    }
+    *tail = head >= 0 ? head : other;
+    return result;
+}
+
+static struct update_group *
+find_update_group(struct update_queue *q, const unsigned char *id)
+{
+    struct update_group *group;
+    int slot;
+
+    if(q->num_groups >= q->max_groups && grow_groups(q) < 0)
+        return NULL;
+
+    slot = find_group_slot(q, id);
+    if(q->group_hash[slot] >= 0)
+        return &q->groups[q->group_hash[slot]];
+
+    group = &q->groups[q->num_groups];
+    memcpy(group->id, id, 8);
+    group->head[0] = group->head[1] = -1;
+    group->tail[0] = group->tail[1] = -1;
+    group->unsorted[0] = group->unsorted[1] = 0;
+    group->slot = slot;
+    q->group_hash[slot] = q->num_groups++;
+    return group;
+}
+
+/* Empty the queue, keeping its memory.  This only touches the hash
+   slots that are in use. */
+static void
+reset_update_queue(struct update_queue *q)
+{
+    int i;
+
+    for(i = 0; i < q->num_updates; i++)
+        q->update_hash[q->updates[i].slot] = -1;
+    for(i = 0; i < q->num_groups; i++)
+        q->group_hash[q->groups[i].slot] = -1;
+    q->num_updates = 0;
+    q->num_groups = 0;
 }
 
 void
-flushupdates(struct interface *ifp)
+flush_update_queue(struct update_queue *q)
+{
+    free(q->updates);
+    free(q->update_hash);
+    free(q->groups);
+    free(q->group_hash);
+    memset(q, 0, sizeof(struct update_queue));
+}
+
+static void
+flush_buffered_update(struct interface *ifp, const struct buffered_update *b)
 {
     struct xroute *xroute;
-    struct babel_route *route;
-    const unsigned char *last_prefix = NULL;
-    const unsigned char *last_src_prefix = NULL;
-    unsigned char last_plen = 0xFF;
-    unsigned char last_src_plen = 0xFF;
-    int i;
+    struct babel_route *route = NULL;
+
+    if(b->xroute_generation == xroute_generation)
+        xroute = b->xroute;
+    else
+        xroute = find_xroute(b->prefix, b->plen, b->src_prefix, b->src_plen);
+
+    if(!xroute || xroute->metric > kernel_metric) {
+        if(b->route_generation == route_slot_generation)
+            route = route_slot_installed(b->route_slot);
+        else
+            route = find_installed_route(b->prefix, b->plen,
+                                         b->src_prefix, b->src_plen);
+    }
+
+    if(xroute && (!route || xroute->metric <= kernel_metric)) {
+        really_send_update(ifp, myid,
+                           xroute->prefix, xroute->plen,
+                           xroute->src_prefix, xroute->src_plen,
+                           myseqno, xroute->metric,
+                           NULL, 0);
+    } else if(route) {
+        unsigned char channels[MAX_CHANNEL_HOPS];
+        int chlen;
+        struct interface *route_ifp = route->neigh->ifp;
+        unsigned short metric;
+        unsigned short seqno;
+
+        seqno = route->seqno;
+        metric =
+            route_interferes(route, ifp) ?
+            route_metric(route) :
+            route_metric_noninterfering(route);
+
+        if(metric < INFINITY)
+            satisfy_request(route->src->prefix, route->src->plen,
+                            route->src->src_prefix,
+                            route->src->src_plen,
+                            seqno, route->src->id, ifp);
+
+        if((ifp->flags & IF_SPLIT_HORIZON) &&
+           route->neigh->ifp == ifp)
+            return;
+
+        if(route_ifp->channel == IF_CHANNEL_NONINTERFERING) {
+            chlen = MIN(route->channels_len, MAX_CHANNEL_HOPS);
+            if(chlen > 0)
+                memcpy(channels, route->channels, chlen);
+        } else {
+            if(route_ifp->channel == IF_CHANNEL_UNKNOWN)
+                channels[0] = IF_CHANNEL_INTERFERING;
+            else {
+                assert(route_ifp->channel > 0 &&
+                       route_ifp->channel <= 255);
+                channels[0] = route_ifp->channel;
+            }
+            memcpy(channels + 1, route->channels,
+                   MIN(route->channels_len, MAX_CHANNEL_HOPS - 1));
+            chlen = 1 + MIN(route->channels_len, MAX_CHANNEL_HOPS - 1);
+        }
+
+        really_send_update(ifp, route->src->id,
+                           route->src->prefix, route->src->plen,
+                           route->src->src_prefix,
+                           route->src->src_plen,
+                           seqno, metric,
+                           channels, chlen);
+        update_source(route->src, seqno, metric);
+    } else {
+        /* There's no route for this prefix.  This can happen shortly
+           after an xroute has been retracted, so send a retraction. */
+        really_send_update(ifp, myid,
+                           b->prefix, b->plen,
+                           b->src_prefix, b->src_plen,
+                           myseqno, INFINITY, NULL, -1);
+    }
+}
+
+void
+flushupdates(struct interface *ifp)
+{
+    struct update_queue *q;
+    struct buffered_update *b;
+    int g, v4, i;
 
     if(ifp == NULL) {
         struct interface *ifp_aux;
@@ -1352,137 +1730,43 @@ flushupdates(struct interface *ifp)
         return;
     }
 
-    if(ifp->num_buffered_updates > 0) {
-        struct buffered_update *b = ifp->buffered_updates;
-        int n = ifp->num_buffered_updates;
-
-        ifp->buffered_updates = NULL;
-        ifp->update_bufsize = 0;
-        ifp->num_buffered_updates = 0;
+    q = &ifp->update_queue;
 
+    if(q->num_updates > 0) {
         if(!if_up(ifp))
             goto done;
 
         debugf("  (flushing %d buffered updates on %s (%d))\n",
-               n, ifp->name, ifp->ifindex);
-
-        /* In order to send fewer update messages, we want to send updates
-           with the same router-id together, with IPv6 going out before IPv4. */
-
-        for(i = 0; i < n; i++) {
-            route = find_installed_route(b[i].prefix, b[i].plen,
-                                         b[i].src_prefix, b[i].src_plen);
-            if(route)
-                memcpy(b[i].id, route->src->id, 8);
-            else
-                memcpy(b[i].id, myid, 8);
-        }
-
-        qsort(b, n, sizeof(struct buffered_update), compare_buffered_updates);
-
-        for(i = 0; i < n; i++) {
-            /* The same update may be scheduled multiple times before it is
-               sent out.  Since our buffer is now sorted, it is enough to
-               compare with the previous update. */
-
-            if(last_prefix &&
-               b[i].plen == last_plen &&
-               b[i].src_plen == last_src_plen &&
-               memcmp(b[i].prefix, last_prefix, 16) == 0 &&
-               memcmp(b[i].src_prefix, last_src_prefix, 16) == 0)
-                continue;
-
-            xroute = find_xroute(b[i].prefix, b[i].plen,
-                                 b[i].src_prefix, b[i].src_plen);
-            route = find_installed_route(b[i].prefix, b[i].plen,
-                                         b[i].src_prefix, b[i].src_plen);
-
-            if(xroute && (!route || xroute->metric <= kernel_metric)) {
-                really_send_update(ifp, myid,
-                                   xroute->prefix, xroute->plen,
-                                   xroute->src_prefix, xroute->src_plen,
-                                   myseqno, xroute->metric,
-                                   NULL, 0);
-                last_prefix = xroute->prefix;
-                last_plen = xroute->plen;
-                last_src_prefix = xroute->src_prefix;
-                last_src_plen = xroute->src_plen;
-            } else if(route) {
-                unsigned char channels[MAX_CHANNEL_HOPS];
-                int chlen;
-                struct interface *route_ifp = route->neigh->ifp;
-                unsigned short metric;
-                unsigned short seqno;
-
-                seqno = route->seqno;
-                metric =
-                    route_interferes(route, ifp) ?
-                    route_metric(route) :
-                    route_metric_noninterfering(route);
-
-                if(metric < INFINITY)
-                    satisfy_request(route->src->prefix, route->src->plen,
-                                    route->src->src_prefix,
-                                    route->src->src_plen,
-                                    seqno, route->src->id, ifp);
-
-                if((ifp->flags & IF_SPLIT_HORIZON) &&
-                   route->neigh->ifp == ifp)
-                    continue;
-
-                if(route_ifp->channel == IF_CHANNEL_NONINTERFERING) {
-                    chlen = MIN(route->channels_len, MAX_CHANNEL_HOPS);
-                    if(chlen > 0)
-                        memcpy(channels, route->channels, chlen);
-                } else {
-                    if(route_ifp->channel == IF_CHANNEL_UNKNOWN)
-                        channels[0] = IF_CHANNEL_INTERFERING;
-                    else {
-                        assert(route_ifp->channel > 0 &&
-                               route_ifp->channel <= 255);
-                        channels[0] = route_ifp->channel;
-                    }
-                    memcpy(channels + 1, route->channels,
-                           MIN(route->channels_len, MAX_CHANNEL_HOPS - 1));
-                    chlen = 1 + MIN(route->channels_len, MAX_CHANNEL_HOPS - 1);
+               q->num_updates, ifp->name, ifp->ifindex);
+
+        /* In order to send fewer update messages, updates are grouped
+           by router-id, with IPv6 going out before IPv4, and sorted by
+           prefix within a group. */
+
+        for(g = 0; g < q->num_groups; g++) {
+            for(v4 = 0; v4 < 2; v4++) {
+                if(q->groups[g].unsorted[v4])
+                    q->groups[g].head[v4] =
+                        sort_update_list(q, q->groups[g].head[v4]);
+                for(i = q->groups[g].head[v4]; i >= 0; i = b->next) {
+                    b = &q->updates[i];
+                    flush_buffered_update(ifp, b);
                 }
-
-                really_send_update(ifp, route->src->id,
-                                   route->src->prefix, route->src->plen,
-                                   route->src->src_prefix,
-                                   route->src->src_plen,
-                                   seqno, metric,
-                                   channels, chlen);
-                update_source(route->src, seqno, metric);
-                last_prefix = route->src->prefix;
-                last_plen = route->src->plen;
-                last_src_prefix = route->src->src_prefix;
-                last_src_plen = route->src->src_plen;
-            } else {
-            /* There's no route for this prefix.  This can happen shortly
-               after an xroute has been retracted, so send a retraction. */
-                really_send_update(ifp, myid,
-                                   b[i].prefix, b[i].plen,
-                                   b[i].src_prefix, b[i].src_plen,
-                                   myseqno, INFINITY, NULL, -1);
             }
         }
 
         if((ifp->flags & IF_UNICAST) != 0) {
             struct neighbour *neigh;
-            FOR_ALL_NEIGHBOURS(neigh) {
-                if(neigh->ifp == ifp) {
-                    schedule_flush_now(&neigh->buf);
-                }
+            FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+                schedule_flush_now(&neigh->buf);
             }
         } else {
             schedule_flush_now(&ifp->buf);
         }
     done:
-        free(b);
+        reset_update_queue(q);
     }
-    ifp->update_flush_timeout.tv_sec = 0;
-    ifp->update_flush_timeout.tv_usec = 0;
+    timer_cancel(&ifp->update_flush_timer);
 }
 
 static void
@@ -1490,10 +1774,65 @@ schedule_update_flush(struct interface *ifp, int urgent)
 {
     unsigned msecs;
     msecs = update_jitter(ifp, urgent);
-    if(ifp->update_flush_timeout.tv_sec != 0 &&
-       timeval_minus_msec(&ifp->update_flush_timeout, &now) < msecs)
+    if(timer_armed(&ifp->update_flush_timer) &&
+       timeval_minus_msec(&ifp->update_flush_timer.time, &now) < msecs)
+        return;
+    set_timeout(&ifp->update_flush_timer, msecs);
+}
+
+/* Queue an update.  The handles are used at flush time if the
+   corresponding generation is still current; pass 0 if unknown. */
+static void
+queue_update(struct interface *ifp, const unsigned char *id,
+             const unsigned char *prefix, unsigned char plen,
+             const unsigned char *src_prefix, unsigned char src_plen,
+             struct route_slot *route_slot, unsigned int route_generation,
+             struct xroute *xroute, unsigned int xroute_generation)
+{
+    struct update_queue *q = &ifp->update_queue;
+    struct update_group *group;
+    struct buffered_update *b;
+    int slot, v4, n;
+
+    if(q->num_updates >= q->max_updates && grow_updates(q) < 0) {
+        perror("malloc(buffered_updates)");
+        return;
+    }
+
+    slot = find_update_slot(q, prefix, plen, src_prefix, src_plen);
+    if(q->update_hash[slot] >= 0)
         return;
-    set_timeout(&ifp->update_flush_timeout, msecs);
+
+    group = find_update_group(q, id);
+    if(group == NULL) {
+        perror("malloc(update_groups)");
+        return;
+    }
+
+    n = q->num_updates++;
+    q->update_hash[slot] = n;
+    b = &q->updates[n];
+    memcpy(b->id, id, 8);
+    memcpy(b->prefix, prefix, 16);
+    b->plen = plen;
+    memcpy(b->src_prefix, src_prefix, 16);
+    b->src_plen = src_plen;
+    b->slot = slot;
+    b->route_slot = route_slot;
+    b->route_generation = route_generation;
+    b->xroute = xroute;
+    b->xroute_generation = xroute_generation;
+
+    v4 = plen >= 96 && v4mapped(prefix);
+    b->next = -1;
+    if(group->tail[v4] >= 0) {
+        if(compare_buffered_updates(&q->updates[group->tail[v4]], b) > 0)
+            group->unsorted[v4] = 1;
+        q->updates[group->tail[v4]].next = n;
+    } else {
+        group->head[v4] = n;
+    }
+    group->tail[v4] = n;
 }
 
 static void
@@ -1501,40 +1840,16 @@ buffer_update(struct interface *ifp,
               const unsigned char *prefix, unsigned char plen,
               const unsigned char *src_prefix, unsigned char src_plen)
 {
-    if(ifp->num_buffered_updates > 0 &&
-       ifp->num_buffered_updates >= ifp->update_bufsize)
-        flushupdates(ifp);
-
-    if(ifp->update_bufsize == 0) {
-        int n;
-        assert(ifp->buffered_updates == NULL);
-        /* Allocate enough space to hold a full update.  Since the
-           number of installed routes will grow over time, make sure we
-           have enough space to send a full-ish frame. */
-        n = installed_routes_estimate() + xroutes_estimate() + 4;
-        n = MAX(n, ifp->buf.size / 16);
-    again:
-        ifp->buffered_updates = malloc(n * sizeof(struct buffered_update));
-        if(ifp->buffered_updates == NULL) {
-            perror("malloc(buffered_updates)");
-            if(n > 4) {
-                /* Try again with a tiny buffer. */
-                n = 4;
-                goto again;
-            }
-            return;
-        }
-        ifp->update_bufsize = n;
-        ifp->num_buffered_updates = 0;
-    }
+    struct route_slot *slot;
+    struct babel_route *route;
+    struct xroute *xroute;
 
-    memcpy(ifp->buffered_updates[ifp->num_buffered_updates].prefix,
-           prefix, 16);
-    ifp->buffered_updates[ifp->num_buffered_updates].plen = plen;
-    memcpy(ifp->buffered_updates[ifp->num_buffered_updates].src_prefix,
-           src_prefix, 16);
-    ifp->buffered_updates[ifp->num_buffered_updates].src_plen = src_plen;
-    ifp->num_buffered_updates++;
+    slot = find_route_slot(prefix, plen, src_prefix, src_plen);
+    route = route_slot_installed(slot);
+    xroute = find_xroute(prefix, plen, src_prefix, src_plen);
+    queue_update(ifp, route ? route->src->id : myid,
+                 prefix, plen, src_prefix, src_plen,
+                 slot, route_slot_generation, xroute, xroute_generation);
 }
 
 /* Full wildcard update with prefix == src_prefix == NULL,
@@ -1584,14 +1899,19 @@ send_update(struct interface *ifp, int urgent,
                                     route->src->src_plen);
                 if((src_prefix && is_ss) || (prefix && !is_ss))
                     continue;
-                buffer_update(ifp, route->src->prefix, route->src->plen,
-                              route->src->src_prefix, route->src->src_plen);
+                /* send_self_update has queued all xroutes, so any
+                   prefix that is new to the queue has no xroute. */
+                queue_update(ifp, route->src->id,
+                             route->src->prefix, route->src->plen,
+                             route->src->src_prefix, route->src->src_plen,
+                             route_stream_slot(routes), route_slot_generation,
+                             NULL, xroute_generation);
             }
             route_stream_done(routes);
         } else {
             fprintf(stderr, "Couldn't allocate route stream.\n");
         }
-        set_timeout(&ifp->update_timeout, ifp->update_interval);
+        set_timeout(&ifp->update_timer, ifp->update_interval);
         ifp->last_update_time = now.tv_sec;
     } else {
         send_update(ifp, urgent, NULL, 0, zeroes, 0);
@@ -1644,10 +1964,8 @@ send_wildcard_retraction(struct interface *ifp)
 
     if((ifp->flags & IF_UNICAST) != 0) {
         struct neighbour *neigh;
-        FOR_ALL_NEIGHBOURS(neigh) {
-            if(neigh->ifp == ifp) {
-                buffer_wildcard_retraction(&neigh->buf, neigh->ifp);
-            }
+        FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+            buffer_wildcard_retraction(&neigh->buf, neigh->ifp);
         }
     } else {
         buffer_wildcard_retraction(&ifp->buf, ifp);
@@ -1675,19 +1993,24 @@ send_self_update(struct interface *ifp)
         return;
     }
 
+    if(!if_up(ifp))
+        return;
+
     debugf("Sending self update to %s.\n", ifp->name);
     xroutes = xroute_stream();
     if(xroutes) {
         while(1) {
             struct xroute *xroute = xroute_stream_next(xroutes);
             if(xroute == NULL) break;
-            send_update(ifp, 0, xroute->prefix, xroute->plen,
-                        xroute->src_prefix, xroute->src_plen);
+            queue_update(ifp, myid, xroute->prefix, xroute->plen,
+                         xroute->src_prefix, xroute->src_plen,
+                         NULL, 0, xroute, xroute_generation);
         }
         xroute_stream_done(xroutes);
     } else {
         fprintf(stderr, "Couldn't allocate xroute stream.\n");
     }
+    schedule_update_flush(ifp, 0);
 }
 
 void
@@ -1737,10 +2060,8 @@ send_ihu(struct neighbour *neigh, struct interface *ifp)
 
     if(neigh == NULL) {
         struct neighbour *ngh;
-        FOR_ALL_NEIGHBOURS(ngh) {
-            if(ngh->ifp == ifp)
-                send_ihu(ngh, ifp);
-        }
+        FOR_INTERFACE_NEIGHBOURS(ngh, ifp)
+            send_ihu(ngh, ifp);
         return;
     }
 
@@ -1797,9 +2118,8 @@ void
 send_marginal_ihu(struct interface *ifp)
 {
     struct neighbour *neigh;
-    FOR_ALL_NEIGHBOURS(neigh) {
-        if(ifp && neigh->ifp != ifp)
-            continue;
+    for(neigh = ifp ? ifp->neighs : neighs; neigh;
+        neigh = ifp ? neigh->ifp_next : neigh->next) {
         if(neigh->txcost >= 384 || (neigh->hello.reach & 0xF000) != 0xF000)
             send_ihu(neigh, ifp);
     }
@@ -1879,11 +2199,9 @@ send_multicast_request(struct interface *ifp,
 
     if((ifp->flags & IF_UNICAST) != 0) {
         struct neighbour *neigh;
-        FOR_ALL_NEIGHBOURS(neigh) {
-            if(neigh->ifp == ifp) {
-                send_request(&neigh->buf, ifp, prefix, plen,
-                             src_prefix, src_plen);
-            }
+        FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+            send_request(&neigh->buf, ifp, prefix, plen,
+                         src_prefix, src_plen);
         }
     } else {
         send_request(&ifp->buf, ifp, prefix, plen, src_prefix, src_plen);
@@ -1975,13 +2293,11 @@ send_multicast_multihop_request(struct interface *ifp,
 
     if((ifp->flags & IF_UNICAST) != 0) {
             struct neighbour *neigh;
-            FOR_ALL_NEIGHBOURS(neigh) {
-                if(neigh->ifp == ifp) {
-                    send_multihop_request(&neigh->buf, neigh->ifp,
-                                          prefix, plen,
-                                          src_prefix, src_plen,
-                                          seqno, id, hop_count);
-                }
+            FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+                send_multihop_request(&neigh->buf, neigh->ifp,
+                                      prefix, plen,
+                                      src_prefix, src_plen,
+                                      seqno, id, hop_count);
             }
     } else {
         send_multihop_request(&ifp->buf, ifp,
@@ -41,6 +41,16 @@ THE SOFTWARE.
 #define SUBTLV_TIMESTAMP 3       /* Used to compute RTT. */
 #define SUBTLV_SOURCE_PREFIX 128 /* Source-specific routing. */
 
+/* Number of TLVs indexed at a time by parse_packet. */
+#define TLV_BATCH 64
+
+/* A TLV located by index_tlvs, at offset bytes into the packet body. */
+struct tlv {
+    unsigned char type;
+    unsigned char len;
+    unsigned short offset;
+};
+
 extern unsigned short myseqno;
 extern struct timeval seqno_time;
 
@@ -48,11 +58,15 @@ extern int broadcast_ihu;
 extern int split_horizon;
 
 extern unsigned char packet_header[4];
+extern unsigned long updates_sent, update_bytes_sent;
 
+int index_tlvs(const unsigned char *body, int bodylen, int *pos,
+               struct tlv *tlvs, int max);
 void parse_packet(const unsigned char *from, struct interface *ifp,
                   const unsigned char *packet, int packetlen);
 void flushbuf(struct buffered *buf, struct interface *ifp);
 void flushupdates(struct interface *ifp);
+void flush_update_queue(struct update_queue *q);
 void send_ack(struct neighbour *neigh, unsigned short nonce,
               unsigned short interval);
 void send_multicast_hello(struct interface *ifp, unsigned interval, int force);
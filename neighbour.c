@@ -31,6 +31,7 @@ THE SOFTWARE.
 
 #include "babeld.h"
 #include "util.h"
+#include "timer.h"
 #include "interface.h"
 #include "neighbour.h"
 #include "source.h"
@@ -41,11 +42,52 @@ THE SOFTWARE.
 
 struct neighbour *neighs = NULL;
 
+/* Neighbours are also chained in a hash table indexed by their address.
+   The interface is only compared, not hashed, since its ifindex may
+   change while the neighbour is alive. */
+static struct neighbour **neighbour_table = NULL;
+static int neighbour_table_size = 0, num_neighbours = 0;
+
+static struct neighbour **
+neighbour_bucket(const unsigned char *address)
+{
+    return &neighbour_table[hash_bytes(HASH_INIT, address, 16) &
+                            (neighbour_table_size - 1)];
+}
+
+/* Neighbours are few, so the table starts small.  It is rebuilt from the
+   neighs list rather than from the old buckets. */
+static int
+grow_neighbour_table(void)
+{
+    int n = neighbour_table_size == 0 ? 16 : 2 * neighbour_table_size;
+    struct neighbour **table;
+    struct neighbour *neigh;
+
+    table = calloc(n, sizeof(struct neighbour*));
+    if(table == NULL)
+        return -1;
+
+    free(neighbour_table);
+    neighbour_table = table;
+    neighbour_table_size = n;
+    FOR_ALL_NEIGHBOURS(neigh) {
+        struct neighbour **bucket = neighbour_bucket(neigh->address);
+        neigh->hash_next = *bucket;
+        *bucket = neigh;
+    }
+    return 1;
+}
+
 static struct neighbour *
 find_neighbour_nocreate(const unsigned char *address, struct interface *ifp)
 {
     struct neighbour *neigh;
-    FOR_ALL_NEIGHBOURS(neigh) {
+
+    if(num_neighbours == 0)
+        return NULL;
+
+    for(neigh = *neighbour_bucket(address); neigh; neigh = neigh->hash_next) {
         if(memcmp(address, neigh->address, 16) == 0 &&
            neigh->ifp == ifp)
             return neigh;
@@ -56,26 +98,43 @@ find_neighbour_nocreate(const unsigned char *address, struct interface *ifp)
 void
 flush_neighbour(struct neighbour *neigh)
 {
+    struct neighbour **p;
+
     flush_neighbour_routes(neigh);
     flush_resends(neigh);
 
-    if(neighs == neigh) {
-        neighs = neigh->next;
-    } else {
-        struct neighbour *previous = neighs;
-        while(previous->next != neigh)
-            previous = previous->next;
-        previous->next = neigh->next;
-    }
+    p = &neighs;
+    while(*p != neigh)
+        p = &(*p)->next;
+    *p = neigh->next;
+
+    p = &neigh->ifp->neighs;
+    while(*p != neigh)
+        p = &(*p)->ifp_next;
+    *p = neigh->ifp_next;
+
+    p = neighbour_bucket(neigh->address);
+    while(*p != neigh)
+        p = &(*p)->hash_next;
+    *p = neigh->hash_next;
+    num_neighbours--;
     local_notify_neighbour(neigh, LOCAL_FLUSH);
+    timer_cancel(&neigh->buf.timer);
     free(neigh->buf.buf);
     free(neigh);
 }
 
+static void
+flush_timer_handler(void *closure)
+{
+    struct neighbour *neigh = closure;
+    flushbuf(&neigh->buf, neigh->ifp);
+}
+
 struct neighbour *
 find_neighbour(const unsigned char *address, struct interface *ifp)
 {
-    struct neighbour *neigh;
+    struct neighbour *neigh, **bucket;
     const struct timeval zero = {0, 0};
     unsigned char *buf;
 
@@ -86,6 +145,12 @@ find_neighbour(const unsigned char *address, struct interface *ifp)
     debugf("Creating neighbour %s on %s.\n",
            format_address(address), ifp->name);
 
+    if(num_neighbours >= neighbour_table_size &&
+       grow_neighbour_table() < 0) {
+        perror("malloc(neighbour_table)");
+        return NULL;
+    }
+
     buf = malloc(ifp->buf.size);
     if(buf == NULL) {
         perror("malloc(neighbour->buf)");
@@ -111,12 +176,19 @@ find_neighbour(const unsigned char *address, struct interface *ifp)
     neigh->buf.size = ifp->buf.size;
     neigh->buf.hello = -1;
     neigh->buf.flush_interval = ifp->buf.flush_interval;
+    timer_init(&neigh->buf.timer, flush_timer_handler, neigh);
     neigh->buf.sin6.sin6_family = AF_INET6;
     memcpy(&neigh->buf.sin6.sin6_addr, address, 16);
     neigh->buf.sin6.sin6_port = htons(protocol_port);
     neigh->buf.sin6.sin6_scope_id = ifp->ifindex;
     neigh->next = neighs;
     neighs = neigh;
+    neigh->ifp_next = ifp->neighs;
+    ifp->neighs = neigh;
+    bucket = neighbour_bucket(address);
+    neigh->hash_next = *bucket;
+    *bucket = neigh;
+    num_neighbours++;
     local_notify_neighbour(neigh, LOCAL_ADD);
     return neigh;
 }
@@ -29,6 +29,8 @@ struct hello_history {
 
 struct neighbour {
     struct neighbour *next;
+    struct neighbour *ifp_next; /* next neighbour on the same interface */
+    struct neighbour *hash_next;
     /* This is -1 when unknown, so don't make it unsigned */
     unsigned char address[16];
     struct hello_history hello;
@@ -46,6 +48,7 @@ struct neighbour {
     struct timeval rtt_time;
     struct interface *ifp;
     struct buffered buf;
+    struct babel_route *routes; /* all routes through this neighbour */
 };
 
 extern struct neighbour *neighs;
@@ -53,6 +56,9 @@ extern struct neighbour *neighs;
 #define FOR_ALL_NEIGHBOURS(_neigh) \
     for(_neigh = neighs; _neigh; _neigh = _neigh->next)
 
+#define FOR_INTERFACE_NEIGHBOURS(_neigh, _ifp) \
+    for(_neigh = (_ifp)->neighs; _neigh; _neigh = _neigh->ifp_next)
+
 void flush_neighbour(struct neighbour *neigh);
 struct neighbour *find_neighbour(const unsigned char *address,
                                  struct interface *ifp);
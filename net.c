@@ -20,7 +20,13 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#if defined(__linux) && !defined(NO_MMSG)
+#define _GNU_SOURCE
+#define USE_MMSG
+#endif
+
 #include <unistd.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
@@ -135,46 +141,166 @@ babel_recv(int s, void *buf, int buflen, struct sockaddr *sin, int slen)
     return rc;
 }
 
+/* Receives up to count datagrams, the i-th one into the buflen bytes at
+   buf + i * buflen.  Returns the number of datagrams received, or -1 if
+   none could be read. */
 int
-babel_send(int s,
-           const void *buf1, int buflen1, const void *buf2, int buflen2,
-           const struct sockaddr *sin, int slen)
+babel_recv_batch(int s, unsigned char *buf, int buflen, int count,
+                 struct sockaddr_in6 *sin6, int *lens)
 {
-    struct iovec iovec[2];
-    struct msghdr msg;
-    int rc, count = 0;
+    int i, rc;
+#ifdef USE_MMSG
+    struct mmsghdr msgs[RECEIVE_BATCH];
+    struct iovec iovecs[RECEIVE_BATCH];
+
+    count = MIN(count, RECEIVE_BATCH);
+    memset(msgs, 0, count * sizeof(struct mmsghdr));
+    for(i = 0; i < count; i++) {
+        iovecs[i].iov_base = buf + i * buflen;
+        iovecs[i].iov_len = buflen;
+        msgs[i].msg_hdr.msg_name = &sin6[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    iovec[0].iov_base = (void*)buf1;
-    iovec[0].iov_len = buflen1;
-    iovec[1].iov_base = (void*)buf2;
-    iovec[1].iov_len = buflen2;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = (struct sockaddr*)sin;
-    msg.msg_namelen = slen;
-    msg.msg_iov = iovec;
-    msg.msg_iovlen = 2;
-
-    /* The Linux kernel can apparently keep returning EAGAIN indefinitely. */
-
- again:
-    rc = sendmsg(s, &msg, 0);
-    if(rc < 0) {
-        if(errno == EINTR) {
-            count++;
-            if(count < 100)
-                goto again;
-        } else if(errno == EAGAIN) {
-            int rc2;
-            rc2 = wait_for_fd(1, s, 5);
-            if(rc2 > 0) {
-                count++;
-                if(count < 100)
-                    goto again;
-            }
-            errno = EAGAIN;
+    rc = recvmmsg(s, msgs, count, MSG_DONTWAIT, NULL);
+    if(rc < 0 && errno == ENOSYS)
+        goto fallback;
+    if(rc <= 0)
+        return rc;
+
+    for(i = 0; i < rc; i++)
+        lens[i] = msgs[i].msg_len;
+    return rc;
+
+ fallback:
+#endif
+    for(i = 0; i < count; i++) {
+        rc = babel_recv(s, buf + i * buflen, buflen,
+                        (struct sockaddr*)&sin6[i],
+                        sizeof(struct sockaddr_in6));
+        if(rc < 0)
+            break;
+        lens[i] = rc;
+    }
+    return i > 0 ? i : -1;
+}
+
+/* Outgoing datagrams are copied into a ring of slots and sent in batches
+   by babel_flush_queue, so that the sending code never blocks. */
+
+struct queued_packet {
+    struct sockaddr_in6 sin6;
+    unsigned char *buf;
+    int len;
+    int size;
+};
+
+static struct queued_packet send_queue[SEND_QUEUE_SIZE];
+static int send_queue_first = 0, send_queue_len = 0;
+unsigned long send_queue_drops = 0;
+
+int
+babel_queue(int s,
+            const void *buf1, int buflen1, const void *buf2, int buflen2,
+            const struct sockaddr_in6 *sin6)
+{
+    struct queued_packet *p;
+    int len = buflen1 + buflen2;
+
+    if(send_queue_len >= SEND_QUEUE_SIZE)
+        babel_flush_queue(s);
+
+    if(send_queue_len >= SEND_QUEUE_SIZE) {
+        send_queue_drops++;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    p = &send_queue[(send_queue_first + send_queue_len) % SEND_QUEUE_SIZE];
+    if(p->size < len) {
+        unsigned char *new_buf = realloc(p->buf, len);
+        if(new_buf == NULL)
+            return -1;
+        p->buf = new_buf;
+        p->size = len;
+    }
+    memcpy(p->buf, buf1, buflen1);
+    memcpy(p->buf + buflen1, buf2, buflen2);
+    p->len = len;
+    p->sin6 = *sin6;
+    send_queue_len++;
+    return len;
+}
+
+/* Hands a batch of datagrams from the head of the queue to the kernel.
+   Returns the number of datagrams sent, or -1. */
+static int
+send_queued(int s)
+{
+    struct queued_packet *p;
+    int rc;
+#ifdef USE_MMSG
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovecs[SEND_BATCH];
+    int n = 0;
+
+    /* Stop at the end of the ring, the rest goes in the next batch. */
+    while(n < SEND_BATCH && n < send_queue_len &&
+          send_queue_first + n < SEND_QUEUE_SIZE) {
+        p = &send_queue[send_queue_first + n];
+        iovecs[n].iov_base = p->buf;
+        iovecs[n].iov_len = p->len;
+        memset(&msgs[n], 0, sizeof(struct mmsghdr));
+        msgs[n].msg_hdr.msg_name = &p->sin6;
+        msgs[n].msg_hdr.msg_namelen = sizeof(p->sin6);
+        msgs[n].msg_hdr.msg_iov = &iovecs[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+        n++;
+    }
+    rc = sendmmsg(s, msgs, n, 0);
+    if(rc >= 0 || errno != ENOSYS)
+        return rc;
+#endif
+
+    p = &send_queue[send_queue_first];
+    rc = sendto(s, p->buf, p->len, 0,
+                (struct sockaddr*)&p->sin6, sizeof(p->sin6));
+    return rc < 0 ? -1 : 1;
+}
+
+/* Sends as many queued datagrams as the socket will take.  Returns the
+   number of datagrams that are still queued, which is non-zero if the
+   socket returned EAGAIN. */
+int
+babel_flush_queue(int s)
+{
+    int i, rc;
+
+    while(send_queue_len > 0) {
+        rc = send_queued(s);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            /* Don't let a single bad destination block the queue. */
+            perror("send");
+            rc = 1;
         }
+
+        for(i = 0; i < rc; i++)
+            VALGRIND_MAKE_MEM_UNDEFINED(send_queue[send_queue_first + i].buf,
+                                        send_queue[send_queue_first + i].size);
+        send_queue_first = (send_queue_first + rc) % SEND_QUEUE_SIZE;
+        send_queue_len -= rc;
     }
-    return rc;
+
+    if(send_queue_len == 0)
+        send_queue_first = 0;
+
+    return send_queue_len;
 }
 
 int
@@ -20,10 +20,29 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+/* Maximum number of datagrams read per wakeup. */
+#ifndef RECEIVE_BATCH
+#define RECEIVE_BATCH 16
+#endif
+
+/* Maximum number of datagrams waiting to be sent, and number of
+   datagrams handed to the kernel per system call. */
+#ifndef SEND_QUEUE_SIZE
+#define SEND_QUEUE_SIZE 512
+#endif
+#ifndef SEND_BATCH
+#define SEND_BATCH 32
+#endif
+
+extern unsigned long send_queue_drops;
+
 int babel_socket(int port);
 int babel_recv(int s, void *buf, int buflen, struct sockaddr *sin, int slen);
-int babel_send(int s,
-               const void *buf1, int buflen1, const void *buf2, int buflen2,
-               const struct sockaddr *sin, int slen);
+int babel_recv_batch(int s, unsigned char *buf, int buflen, int count,
+                     struct sockaddr_in6 *sin6, int *lens);
+int babel_queue(int s,
+                const void *buf1, int buflen1, const void *buf2, int buflen2,
+                const struct sockaddr_in6 *sin6);
+int babel_flush_queue(int s);
 int tcp_server_socket(int port, int local);
 int unix_server_socket(const char *path);
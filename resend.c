@@ -29,14 +29,21 @@ THE SOFTWARE.
 
 #include "babeld.h"
 #include "util.h"
+#include "timer.h"
 #include "interface.h"
 #include "neighbour.h"
 #include "resend.h"
 #include "message.h"
 #include "configuration.h"
 
-struct timeval resend_time = {0, 0};
-struct resend *to_resend = NULL;
+/* Resends are indexed by a chained hash table on their kind and
+   destination.  They are also kept on a list in expiry order: the head
+   holds records that have been satisfied or have run out of resends,
+   and the rest is sorted by time, so that expire_resend can stop at
+   the first live request. */
+static struct resend **resend_table = NULL;
+static int resend_table_size = 0, num_resends = 0;
+static struct resend *to_resend = NULL, *last_resend = NULL;
 
 static int
 resend_match(struct resend *resend,
@@ -49,6 +56,144 @@ resend_match(struct resend *resend,
             memcmp(resend->src_prefix, src_prefix, 16) == 0);
 }
 
+static unsigned int
+resend_hash(int kind, const unsigned char *prefix, unsigned char plen,
+            const unsigned char *src_prefix, unsigned char src_plen)
+{
+    unsigned char k = kind;
+    unsigned int h = hash_bytes(HASH_INIT, &k, 1);
+    h = hash_bytes(h, prefix, 16);
+    h = hash_bytes(h, &plen, 1);
+    h = hash_bytes(h, src_prefix, 16);
+    h = hash_bytes(h, &src_plen, 1);
+    return h;
+}
+
+static struct resend **
+resend_bucket(const struct resend *resend)
+{
+    return &resend_table[resend_hash(resend->kind, resend->prefix,
+                                     resend->plen, resend->src_prefix,
+                                     resend->src_plen) &
+                         (resend_table_size - 1)];
+}
+
+/* Called when there are as many resends as buckets.  Resends are moved
+   over bucket by bucket; if allocation fails, the old table stays. */
+static int
+grow_resend_table(void)
+{
+    int n = resend_table_size == 0 ? 64 : 2 * resend_table_size;
+    struct resend **old = resend_table;
+    int old_size = resend_table_size, i;
+
+    resend_table = calloc(n, sizeof(struct resend*));
+    if(resend_table == NULL) {
+        resend_table = old;
+        return -1;
+    }
+    resend_table_size = n;
+
+    for(i = 0; i < old_size; i++) {
+        struct resend *r = old[i];
+        while(r) {
+            struct resend *next = r->hash_next;
+            struct resend **bucket = resend_bucket(r);
+            r->hash_next = *bucket;
+            *bucket = r;
+            r = next;
+        }
+    }
+    free(old);
+    return 1;
+}
+
+static void
+unlink_resend(struct resend *resend)
+{
+    if(resend->prev)
+        resend->prev->next = resend->next;
+    else
+        to_resend = resend->next;
+    if(resend->next)
+        resend->next->prev = resend->prev;
+    else
+        last_resend = resend->prev;
+    resend->next = resend->prev = NULL;
+}
+
+/* Called when resend->time has been set to now. */
+static void
+move_resend_last(struct resend *resend)
+{
+    if(resend == last_resend)
+        return;
+    if(resend->prev || resend == to_resend)
+        unlink_resend(resend);
+    resend->prev = last_resend;
+    if(last_resend)
+        last_resend->next = resend;
+    else
+        to_resend = resend;
+    last_resend = resend;
+}
+
+/* Called when resend has just expired. */
+static void
+move_resend_first(struct resend *resend)
+{
+    if(resend == to_resend)
+        return;
+    unlink_resend(resend);
+    resend->next = to_resend;
+    if(to_resend)
+        to_resend->prev = resend;
+    else
+        last_resend = resend;
+    to_resend = resend;
+}
+
+static void resend_timeout(void *closure);
+
+static int
+resend_expired(struct resend *resend)
+{
+    switch(resend->kind) {
+    case RESEND_REQUEST:
+        return timeval_minus_msec(&now, &resend->time) >= REQUEST_TIMEOUT;
+    default:
+        return resend->max <= 0;
+    }
+}
+
+/* Arms the timer of resend for its next transmission, if any.  Each
+   transmission doubles the delay, which is counted from resend->time. */
+static void
+schedule_resend(struct resend *resend)
+{
+    if(!resend_expired(resend) && resend->delay > 0 && resend->max > 0) {
+        struct timeval timeout;
+        timeval_add_msec(&timeout, &resend->time, resend->delay);
+        timer_set(&resend->timer, &timeout);
+    } else {
+        timer_cancel(&resend->timer);
+    }
+}
+
+static void
+free_resend(struct resend *resend)
+{
+    struct resend **p = resend_bucket(resend);
+
+    while(*p != resend)
+        p = &(*p)->hash_next;
+    *p = resend->hash_next;
+    unlink_resend(resend);
+    timer_cancel(&resend->timer);
+    num_resends--;
+    free(resend);
+}
+
 /* This is called by neigh.c when a neighbour is flushed */
 
 void
@@ -59,21 +204,20 @@ flush_resends(struct neighbour *neigh)
 
 static struct resend *
 find_resend(int kind, const unsigned char *prefix, unsigned char plen,
-            const unsigned char *src_prefix, unsigned char src_plen,
-            struct resend **previous_return)
+            const unsigned char *src_prefix, unsigned char src_plen)
 {
-    struct resend *current, *previous;
+    struct resend *current;
 
-    previous = NULL;
-    current = to_resend;
+    if(num_resends == 0)
+        return NULL;
+
+    current = resend_table[resend_hash(kind, prefix, plen,
+                                       src_prefix, src_plen) &
+                           (resend_table_size - 1)];
     while(current) {
-        if(resend_match(current, kind, prefix, plen, src_prefix, src_plen)) {
-            if(previous_return)
-                *previous_return = previous;
+        if(resend_match(current, kind, prefix, plen, src_prefix, src_plen))
             return current;
-        }
-        previous = current;
-        current = current->next;
+        current = current->hash_next;
     }
 
     return NULL;
@@ -81,11 +225,9 @@ find_resend(int kind, const unsigned char *prefix, unsigned char plen,
 
 struct resend *
 find_request(const unsigned char *prefix, unsigned char plen,
-             const unsigned char *src_prefix, unsigned char src_plen,
-             struct resend **previous_return)
+             const unsigned char *src_prefix, unsigned char src_plen)
 {
-    return find_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen,
-                       previous_return);
+    return find_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen);
 }
 
 int
@@ -109,7 +251,7 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
     if(delay >= 0xFFFF)
         delay = 0xFFFF;
 
-    resend = find_resend(kind, prefix, plen, src_prefix, src_plen, NULL);
+    resend = find_resend(kind, prefix, plen, src_prefix, src_plen);
     if(resend) {
         if(resend->delay && delay)
             resend->delay = MIN(resend->delay, delay);
@@ -117,8 +259,10 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
             resend->delay = delay;
         resend->time = now;
         resend->max = RESEND_MAX;
+        move_resend_last(resend);
         if(id && memcmp(resend->id, id, 8) == 0 &&
            seqno_compare(resend->seqno, seqno) > 0) {
+            schedule_resend(resend);
             return 0;
         }
         if(id)
@@ -129,9 +273,13 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
         if(resend->ifp != ifp)
             resend->ifp = NULL;
     } else {
+        struct resend **bucket;
+        if(num_resends >= resend_table_size && grow_resend_table() < 0)
+            return -1;
         resend = calloc(1, sizeof(struct resend));
         if(resend == NULL)
             return -1;
+        timer_init(&resend->timer, resend_timeout, resend);
         resend->kind = kind;
         resend->max = RESEND_MAX;
         resend->delay = delay;
@@ -144,29 +292,17 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
             memcpy(resend->id, id, 8);
         resend->ifp = ifp;
         resend->time = now;
-        resend->next = to_resend;
-        to_resend = resend;
+        bucket = resend_bucket(resend);
+        resend->hash_next = *bucket;
+        *bucket = resend;
+        num_resends++;
+        move_resend_last(resend);
     }
 
-    if(resend->delay) {
-        struct timeval timeout;
-        timeval_add_msec(&timeout, &resend->time, resend->delay);
-        timeval_min(&resend_time, &timeout);
-    }
+    schedule_resend(resend);
     return 1;
 }
 
-static int
-resend_expired(struct resend *resend)
-{
-    switch(resend->kind) {
-    case RESEND_REQUEST:
-        return timeval_minus_msec(&now, &resend->time) >= REQUEST_TIMEOUT;
-    default:
-        return resend->max <= 0;
-    }
-}
-
 int
 unsatisfied_request(const unsigned char *prefix, unsigned char plen,
                     const unsigned char *src_prefix, unsigned char src_plen,
@@ -174,7 +310,7 @@ unsatisfied_request(const unsigned char *prefix, unsigned char plen,
 {
     struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, NULL);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL || resend_expired(request))
         return 0;
 
@@ -194,7 +330,7 @@ request_redundant(struct interface *ifp,
 {
     struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, NULL);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL || resend_expired(request))
         return 0;
 
@@ -223,9 +359,9 @@ satisfy_request(const unsigned char *prefix, unsigned char plen,
                 unsigned short seqno, const unsigned char *id,
                 struct interface *ifp)
 {
-    struct resend *request, *previous;
+    struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, &previous);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL)
         return 0;
 
@@ -238,93 +374,59 @@ satisfy_request(const unsigned char *prefix, unsigned char plen,
            now.  Mark it as expired, so that expire_resend will remove it. */
         request->max = 0;
         request->time.tv_sec = 0;
-        recompute_resend_time();
+        move_resend_first(request);
+        timer_cancel(&request->timer);
         return 1;
     }
 
     return 0;
 }
 
+/* Requests further down the list are more recent than the first live
+   one, so we only need to look at updates past it. */
 void
 expire_resend()
 {
-    struct resend *current, *previous;
-    int recompute = 0;
+    struct resend *current, *next;
 
-    previous = NULL;
     current = to_resend;
     while(current) {
+        next = current->next;
         if(resend_expired(current)) {
-            if(previous == NULL) {
-                to_resend = current->next;
-                free(current);
-                current = to_resend;
-            } else {
-                previous->next = current->next;
-                free(current);
-                current = previous->next;
-            }
-            recompute = 1;
-        } else {
-            previous = current;
-            current = current->next;
+            free_resend(current);
+        } else if(current->kind == RESEND_REQUEST) {
+            break;
         }
+        current = next;
     }
-    if(recompute)
-        recompute_resend_time();
 }
 
-void
-recompute_resend_time()
+static void
+resend_timeout(void *closure)
 {
-    struct resend *request;
-    struct timeval resend = {0, 0};
-
-    request = to_resend;
-    while(request) {
-        if(!resend_expired(request) && request->delay > 0 && request->max > 0) {
-            struct timeval timeout;
-            timeval_add_msec(&timeout, &request->time, request->delay);
-            timeval_min(&resend, &timeout);
-        }
-        request = request->next;
-    }
+    struct resend *resend = closure;
 
-    resend_time = resend;
-}
+    if(resend_expired(resend))
+        return;
 
-void
-do_resend()
-{
-    struct resend *resend;
-
-    resend = to_resend;
-    while(resend) {
-        if(!resend_expired(resend) && resend->delay > 0 && resend->max > 0) {
-            struct timeval timeout;
-            timeval_add_msec(&timeout, &resend->time, resend->delay);
-            if(timeval_compare(&now, &timeout) >= 0) {
-                switch(resend->kind) {
-                case RESEND_REQUEST:
-                    send_multicast_multihop_request(resend->ifp,
-                                                    resend->prefix, resend->plen,
-                                                    resend->src_prefix,
-                                                    resend->src_plen,
-                                                    resend->seqno, resend->id,
-                                                    127);
-                    break;
-                case RESEND_UPDATE:
-                    send_update(resend->ifp, 1,
-                                resend->prefix, resend->plen,
-                                resend->src_prefix, resend->src_plen);
-                    break;
-                default: abort();
-                }
-                resend->delay = MIN(0xFFFF, resend->delay * 2);
-                resend->max--;
-            }
-        }
-        resend = resend->next;
+    switch(resend->kind) {
+    case RESEND_REQUEST:
+        send_multicast_multihop_request(resend->ifp,
+                                        resend->prefix, resend->plen,
+                                        resend->src_prefix, resend->src_plen,
+                                        resend->seqno, resend->id, 127);
+        break;
+    case RESEND_UPDATE:
+        send_update(resend->ifp, 1,
+                    resend->prefix, resend->plen,
+                    resend->src_prefix, resend->src_plen);
+        break;
+    default: abort();
     }
-    recompute_resend_time();
+    resend->delay = MIN(0xFFFF, resend->delay * 2);
+    resend->max--;
+    if(resend_expired(resend))
+        move_resend_first(resend);
+    else
+        schedule_resend(resend);
 }
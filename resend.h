@@ -38,14 +38,13 @@ struct resend {
     unsigned short seqno;
     unsigned char id[8];
     struct interface *ifp;
-    struct resend *next;
+    struct timer timer;         /* next transmission */
+    struct resend *next, *prev;  /* in expiry order */
+    struct resend *hash_next;
 };
 
-extern struct timeval resend_time;
-
 struct resend *find_request(const unsigned char *prefix, unsigned char plen,
-                    const unsigned char *src_prefix, unsigned char src_plen,
-                    struct resend **previous_return);
+                    const unsigned char *src_prefix, unsigned char src_plen);
 void flush_resends(struct neighbour *neigh);
 int record_resend(int kind, const unsigned char *prefix, unsigned char plen,
                   const unsigned char *src_prefix, unsigned char src_plen,
@@ -64,5 +63,3 @@ int satisfy_request(const unsigned char *prefix, unsigned char plen,
                     struct interface *ifp);
 
 void expire_resend(void);
-void recompute_resend_time(void);
-void do_resend(void);
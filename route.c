@@ -25,10 +25,12 @@ THE SOFTWARE.
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
 #include <sys/time.h>
 
 #include "babeld.h"
 #include "util.h"
+#include "timer.h"
 #include "kernel.h"
 #include "interface.h"
 #include "source.h"
@@ -40,8 +42,11 @@ THE SOFTWARE.
 #include "configuration.h"
 #include "local.h"
 
-struct babel_route **routes = NULL;
-static int route_slots = 0, max_route_slots = 0;
+static void *route_root = NULL;
+static int route_slots = 0;
+/* Bumped whenever a slot is created or freed, which invalidates any
+   struct route_slot pointer held outside this file. */
+unsigned int route_slot_generation = 1;
 int kernel_metric = 0, reflect_kernel_metric = 0;
 int allow_duplicates = -1;
 int diversity_kind = DIVERSITY_NONE;
@@ -50,95 +55,294 @@ int diversity_factor = 256;     /* in units of 1/256 */
 static int smoothing_half_life = 0;
 static int two_to_the_one_over_hl = 0; /* 2^(1/hl) * 0x10000 */
 
-/* We maintain a list of "slots", ordered by prefix.  Every slot
+/* We maintain a set of "slots", ordered by prefix.  Every slot
    contains a linked list of the routes to this prefix, with the
-   installed route, if any, at the head of the list. */
+   installed route, if any, at the head of the list.
 
-static int
-route_compare(const unsigned char *prefix, unsigned char plen,
-              const unsigned char *src_prefix, unsigned char src_plen,
-              struct babel_route *route)
+   The slots are the leaves of a crit-bit tree (a path-compressed binary
+   trie) indexed by a fixed-length key built from the prefix and the
+   source prefix.  Internal nodes only record the first bit at which
+   their two subtrees differ, so lookup, insertion and deletion cost
+   O(key length), and an in-order walk yields the slots in the same
+   order as the sorted array that this replaces. */
+
+#define ROUTE_KEY_LEN 35
+
+struct route_slot {
+    unsigned char key[ROUTE_KEY_LEN];
+    int dirty;                  /* 1 + index in dirty_slots, or 0 */
+    struct babel_route *routes;
+};
+
+struct route_node {
+    void *child[2];
+    unsigned short bit;
+};
+
+/* Destinations whose routes were changed by received updates.  Route
+   selection for them is deferred to select_dirty_routes, so that a
+   batch of updates leads to a single selection per destination. */
+struct dirty_slot {
+    struct route_slot *slot;
+    struct source *oldsrc;      /* installed before the batch, or NULL */
+    unsigned short oldmetric;
+    short changed;              /* the installed route was updated */
+};
+
+static struct dirty_slot *dirty_slots = NULL;
+static int num_dirty_slots = 0, max_dirty_slots = 0;
+
+/* Internal nodes are distinguished from slots by the low bit of the
+   pointer. */
+#define IS_NODE(p) (((uintptr_t)(p)) & 1)
+#define TO_NODE(p) ((struct route_node*)((uintptr_t)(p) - 1))
+#define FROM_NODE(n) ((void*)((uintptr_t)(n) + 1))
+
+/* The key sorts source-specific routes first, then by prefix, prefix
+   length and source prefix, just like the comparison we used to do. */
+
+static void
+route_key(unsigned char *key,
+          const unsigned char *prefix, unsigned char plen,
+          const unsigned char *src_prefix, unsigned char src_plen)
 {
-    int i;
     int is_ss = !is_default(src_prefix, src_plen);
-    int is_ss_rt = !is_default(route->src->src_prefix, route->src->src_plen);
 
-    /* Put all source-specific routes in the front of the list. */
-    if(!is_ss && is_ss_rt) {
-        return 1;
-    } else if(is_ss && !is_ss_rt) {
-        return -1;
+    key[0] = is_ss ? 0 : 1;
+    memcpy(key + 1, prefix, 16);
+    key[17] = plen;
+    if(is_ss) {
+        memcpy(key + 18, src_prefix, 16);
+        key[34] = src_plen;
+    } else {
+        memset(key + 18, 0, 17);
     }
+}
+
+static void
+route_src_key(unsigned char *key, const struct source *src)
+{
+    route_key(key, src->prefix, src->plen, src->src_prefix, src->src_plen);
+}
 
-    i = memcmp(prefix, route->src->prefix, 16);
-    if(i != 0)
-        return i;
+static inline int
+key_bit(const unsigned char *key, int bit)
+{
+    return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/* Returns the index of the first bit where a and b differ, or -1. */
+static int
+key_crit_bit(const unsigned char *a, const unsigned char *b)
+{
+    int i, bit;
+    unsigned char d;
 
-    if(plen < route->src->plen)
+    for(i = 0; i < ROUTE_KEY_LEN; i++) {
+        if(a[i] != b[i])
+            break;
+    }
+    if(i >= ROUTE_KEY_LEN)
         return -1;
-    if(plen > route->src->plen)
-        return 1;
 
-    if(is_ss) {
-        i = memcmp(src_prefix, route->src->src_prefix, 16);
-        if(i != 0)
-            return i;
-        if(src_plen < route->src->src_plen)
-            return -1;
-        if(src_plen > route->src->src_plen)
-            return 1;
+    d = a[i] ^ b[i];
+    bit = 0;
+    while(!(d & 0x80)) {
+        d <<= 1;
+        bit++;
     }
+    return i * 8 + bit;
+}
 
-    return 0;
+static struct route_slot *
+first_slot_under(void *p)
+{
+    while(IS_NODE(p))
+        p = TO_NODE(p)->child[0];
+    return p;
 }
 
-/* Performs binary search, returns -1 in case of failure.  In the latter
-   case, new_return is the place where to insert the new element. */
+static void
+bump_route_slot_generation(void)
+{
+    route_slot_generation++;
+    if(route_slot_generation == 0)
+        route_slot_generation = 1;
+}
 
-static int
+struct route_slot *
 find_route_slot(const unsigned char *prefix, unsigned char plen,
-                const unsigned char *src_prefix, unsigned char src_plen,
-                int *new_return)
+                const unsigned char *src_prefix, unsigned char src_plen)
 {
-    int p, m, g, c;
+    unsigned char key[ROUTE_KEY_LEN];
+    struct route_slot *slot;
+    void *p = route_root;
 
-    if(route_slots < 1) {
-        if(new_return)
-            *new_return = 0;
-        return -1;
+    if(p == NULL)
+        return NULL;
+
+    route_key(key, prefix, plen, src_prefix, src_plen);
+    while(IS_NODE(p)) {
+        struct route_node *node = TO_NODE(p);
+        p = node->child[key_bit(key, node->bit)];
     }
 
-    p = 0; g = route_slots - 1;
+    slot = p;
+    if(memcmp(slot->key, key, ROUTE_KEY_LEN) != 0)
+        return NULL;
+    return slot;
+}
 
-    do {
-        m = (p + g) / 2;
-        c = route_compare(prefix, plen, src_prefix, src_plen, routes[m]);
-        if(c == 0)
-            return m;
-        else if(c < 0)
-            g = m - 1;
-        else
-            p = m + 1;
-    } while(p <= g);
+/* Returns the first slot whose key is larger than key (or equal to it
+   if strict is false).  If key is NULL, returns the first slot.  The
+   key need not be in the tree, which allows walking the table while
+   it is being modified. */
 
-    if(new_return)
-        *new_return = p;
+static struct route_slot *
+next_route_slot(const unsigned char *key, int strict)
+{
+    struct route_node *path[ROUTE_KEY_LEN * 8];
+    int dirs[ROUTE_KEY_LEN * 8];
+    int depth = 0, cut, crit, i;
+    struct route_slot *slot;
+    void *p = route_root;
+
+    if(p == NULL)
+        return NULL;
+    if(key == NULL)
+        return first_slot_under(p);
+
+    while(IS_NODE(p)) {
+        struct route_node *node = TO_NODE(p);
+        path[depth] = node;
+        dirs[depth] = key_bit(key, node->bit);
+        p = node->child[dirs[depth]];
+        depth++;
+    }
+    slot = p;
 
-    return -1;
+    crit = key_crit_bit(key, slot->key);
+    if(crit < 0) {
+        if(!strict)
+            return slot;
+        cut = depth;
+    } else {
+        /* Every key below the first node that tests a bit beyond crit
+           differs from key at crit in the same way. */
+        cut = 0;
+        while(cut < depth && path[cut]->bit < crit)
+            cut++;
+        if(!key_bit(key, crit))
+            return first_slot_under(cut < depth ?
+                                    FROM_NODE(path[cut]) : (void*)slot);
+    }
+
+    for(i = cut - 1; i >= 0; i--) {
+        if(dirs[i] == 0)
+            return first_slot_under(path[i]->child[1]);
+    }
+    return NULL;
 }
 
-struct babel_route *
-find_route(const unsigned char *prefix, unsigned char plen,
-           const unsigned char *src_prefix, unsigned char src_plen,
-           struct neighbour *neigh)
+/* Returns the slot for key, creating it if necessary. */
+static struct route_slot *
+insert_route_slot(const unsigned char *key)
+{
+    struct route_slot *slot, *best;
+    struct route_node *node;
+    void **where;
+    void *p = route_root;
+    int crit;
+
+    if(p == NULL) {
+        slot = calloc(1, sizeof(struct route_slot));
+        if(slot == NULL)
+            return NULL;
+        memcpy(slot->key, key, ROUTE_KEY_LEN);
+        route_root = slot;
+        route_slots++;
+        bump_route_slot_generation();
+        return slot;
+    }
+
+    while(IS_NODE(p)) {
+        node = TO_NODE(p);
+        p = node->child[key_bit(key, node->bit)];
+    }
+    best = p;
+
+    crit = key_crit_bit(key, best->key);
+    if(crit < 0)
+        return best;
+
+    slot = calloc(1, sizeof(struct route_slot));
+    if(slot == NULL)
+        return NULL;
+    node = malloc(sizeof(struct route_node));
+    if(node == NULL) {
+        free(slot);
+        return NULL;
+    }
+    memcpy(slot->key, key, ROUTE_KEY_LEN);
+
+    where = &route_root;
+    while(IS_NODE(*where)) {
+        struct route_node *n = TO_NODE(*where);
+        if(n->bit > crit)
+            break;
+        where = &n->child[key_bit(key, n->bit)];
+    }
+
+    node->bit = crit;
+    node->child[key_bit(key, crit)] = slot;
+    node->child[!key_bit(key, crit)] = *where;
+    *where = FROM_NODE(node);
+    route_slots++;
+    bump_route_slot_generation();
+    return slot;
+}
+
+static void
+flush_route_slot(struct route_slot *slot)
+{
+    struct route_node *parent = NULL;
+    void **where = &route_root, **parent_where = NULL;
+    int dir = 0;
+
+    assert(slot->routes == NULL);
+
+    while(IS_NODE(*where)) {
+        parent = TO_NODE(*where);
+        parent_where = where;
+        dir = key_bit(slot->key, parent->bit);
+        where = &parent->child[dir];
+    }
+    assert(*where == slot);
+
+    if(slot->dirty)
+        dirty_slots[slot->dirty - 1].slot = NULL;
+
+    if(parent == NULL) {
+        route_root = NULL;
+    } else {
+        *parent_where = parent->child[!dir];
+        free(parent);
+    }
+
+    free(slot);
+    route_slots--;
+    bump_route_slot_generation();
+}
+
+static struct babel_route *
+slot_route(const struct route_slot *slot, struct neighbour *neigh)
 {
     struct babel_route *route;
-    int i = find_route_slot(prefix, plen, src_prefix, src_plen, NULL);
 
-    if(i < 0)
+    if(slot == NULL)
         return NULL;
 
-    route = routes[i];
+    route = slot->routes;
 
     while(route) {
         if(route->neigh == neigh)
@@ -149,15 +353,28 @@ find_route(const unsigned char *prefix, unsigned char plen,
     return NULL;
 }
 
+struct babel_route *
+find_route(const unsigned char *prefix, unsigned char plen,
+           const unsigned char *src_prefix, unsigned char src_plen,
+           struct neighbour *neigh)
+{
+    return slot_route(find_route_slot(prefix, plen, src_prefix, src_plen),
+                      neigh);
+}
+
 struct babel_route *
 find_installed_route(const unsigned char *prefix, unsigned char plen,
                      const unsigned char *src_prefix, unsigned char src_plen)
 {
-    int i = find_route_slot(prefix, plen, src_prefix, src_plen, NULL);
-
-    if(i >= 0 && routes[i]->installed)
-        return routes[i];
+    return route_slot_installed(find_route_slot(prefix, plen,
+                                                src_prefix, src_plen));
+}
 
+struct babel_route *
+route_slot_installed(const struct route_slot *slot)
+{
+    if(slot && slot->routes->installed)
+        return slot->routes;
     return NULL;
 }
 
@@ -168,24 +385,28 @@ installed_routes_estimate(void)
     return route_slots;
 }
 
-static int
-resize_route_table(int new_slots)
+static void
+link_neighbour_route(struct babel_route *route)
 {
-    struct babel_route **new_routes;
-    assert(new_slots >= route_slots);
+    struct neighbour *neigh = route->neigh;
 
-    if(new_slots == 0) {
-        new_routes = NULL;
-        free(routes);
-    } else {
-        new_routes = realloc(routes, new_slots * sizeof(struct babel_route*));
-        if(new_routes == NULL)
-            return -1;
-    }
+    route->neigh_prev = NULL;
+    route->neigh_next = neigh->routes;
+    if(neigh->routes)
+        neigh->routes->neigh_prev = route;
+    neigh->routes = route;
+}
 
-    max_route_slots = new_slots;
-    routes = new_routes;
-    return 1;
+static void
+unlink_neighbour_route(struct babel_route *route)
+{
+    if(route->neigh_prev)
+        route->neigh_prev->neigh_next = route->neigh_next;
+    else
+        route->neigh->routes = route->neigh_next;
+    if(route->neigh_next)
+        route->neigh_next->neigh_prev = route->neigh_prev;
+    route->neigh_next = route->neigh_prev = NULL;
 }
 
 /* Insert a route into the table.  If successful, retains the route.
@@ -193,33 +414,28 @@ resize_route_table(int new_slots)
 static struct babel_route *
 insert_route(struct babel_route *route)
 {
-    int i, n;
+    unsigned char key[ROUTE_KEY_LEN];
+    struct route_slot *slot;
 
     assert(!route->installed);
 
-    i = find_route_slot(route->src->prefix, route->src->plen,
-                        route->src->src_prefix, route->src->src_plen, &n);
+    route_src_key(key, route->src);
+    slot = insert_route_slot(key);
+    if(slot == NULL)
+        return NULL;
 
-    if(i < 0) {
-        if(route_slots >= max_route_slots)
-            resize_route_table(max_route_slots < 1 ? 8 : 2 * max_route_slots);
-        if(route_slots >= max_route_slots)
-            return NULL;
-        route->next = NULL;
-        if(n < route_slots)
-            memmove(routes + n + 1, routes + n,
-                    (route_slots - n) * sizeof(struct babel_route*));
-        route_slots++;
-        routes[n] = route;
+    route->next = NULL;
+    if(slot->routes == NULL) {
+        slot->routes = route;
     } else {
         struct babel_route *r;
-        r = routes[i];
+        r = slot->routes;
         while(r->next)
             r = r->next;
         r->next = route;
-        route->next = NULL;
     }
 
+    link_neighbour_route(route);
     return route;
 }
 
@@ -233,7 +449,7 @@ destroy_route(struct babel_route *route)
 void
 flush_route(struct babel_route *route)
 {
-    int i;
+    struct route_slot *slot;
     struct source *src;
     unsigned oldmetric;
     int lost = 0;
@@ -246,32 +462,23 @@ flush_route(struct babel_route *route)
         lost = 1;
     }
 
-    i = find_route_slot(route->src->prefix, route->src->plen,
-                        route->src->src_prefix, route->src->src_plen, NULL);
-    assert(i >= 0 && i < route_slots);
+    slot = find_route_slot(route->src->prefix, route->src->plen,
+                           route->src->src_prefix, route->src->src_plen);
+    assert(slot != NULL);
 
     local_notify_route(route, LOCAL_FLUSH);
 
-    if(route == routes[i]) {
-        routes[i] = route->next;
+    unlink_neighbour_route(route);
+
+    if(route == slot->routes) {
+        slot->routes = route->next;
         route->next = NULL;
         destroy_route(route);
 
-        if(routes[i] == NULL) {
-            if(i < route_slots - 1)
-                memmove(routes + i, routes + i + 1,
-                        (route_slots - i - 1) * sizeof(struct babel_route*));
-            routes[route_slots - 1] = NULL;
-            route_slots--;
-            VALGRIND_MAKE_MEM_UNDEFINED(routes + route_slots, sizeof(struct route *));
-        }
-
-        if(route_slots == 0)
-            resize_route_table(0);
-        else if(max_route_slots > 8 && route_slots < max_route_slots / 4)
-            resize_route_table(max_route_slots / 2);
+        if(slot->routes == NULL)
+            flush_route_slot(slot);
     } else {
-        struct babel_route *r = routes[i];
+        struct babel_route *r = slot->routes;
         while(r->next != route)
             r = r->next;
         r->next = route->next;
@@ -288,18 +495,12 @@ flush_route(struct babel_route *route)
 void
 flush_all_routes()
 {
-    int i;
-
-    /* Start from the end, to avoid shifting the table. */
-    i = route_slots - 1;
-    while(i >= 0) {
-        while(i < route_slots) {
-            /* Uninstall first, to avoid calling route_lost. */
-            if(routes[i]->installed)
-                uninstall_route(routes[i]);
-            flush_route(routes[i]);
-        }
-        i--;
+    while(route_root != NULL) {
+        struct babel_route *r = first_slot_under(route_root)->routes;
+        /* Uninstall first, to avoid calling route_lost. */
+        if(r->installed)
+            uninstall_route(r);
+        flush_route(r);
     }
 
     check_sources_released();
@@ -308,51 +509,36 @@ flush_all_routes()
 void
 flush_neighbour_routes(struct neighbour *neigh)
 {
-    int i;
-
-    i = 0;
-    while(i < route_slots) {
-        struct babel_route *r;
-        r = routes[i];
-        while(r) {
-            if(r->neigh == neigh) {
-                flush_route(r);
-                goto again;
-            }
-            r = r->next;
-        }
-        i++;
-    again:
-        ;
-    }
+    while(neigh->routes)
+        flush_route(neigh->routes);
 }
 
+/* Routes through an interface are found through its neighbours. */
 void
 flush_interface_routes(struct interface *ifp, int v4only)
 {
-    int i;
+    struct neighbour *neigh;
 
-    i = 0;
-    while(i < route_slots) {
-        struct babel_route *r;
-        r = routes[i];
+    FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+        struct babel_route *r, *next;
+        r = neigh->routes;
         while(r) {
-            if(r->neigh->ifp == ifp &&
-               (!v4only || v4mapped(r->nexthop))) {
+            next = r->neigh_next;
+            if(!v4only || v4mapped(r->nexthop))
                 flush_route(r);
-                goto again;
-            }
-            r = r->next;
+            r = next;
         }
-        i++;
-    again:
-        ;
     }
 }
 
+/* A stream remembers the key of the last slot it returned rather than
+   a position, so that it survives insertions and deletions. */
+
 struct route_stream {
     int installed;
-    int index;
+    int started;
+    unsigned char key[ROUTE_KEY_LEN];
+    struct route_slot *slot;
     struct babel_route *next;
 };
 
@@ -367,7 +553,7 @@ route_stream(int installed)
         return NULL;
 
     stream->installed = installed;
-    stream->index = installed ? 0 : -1;
+    stream->started = 0;
     stream->next = NULL;
 
     return stream;
@@ -376,24 +562,28 @@ route_stream(int installed)
 struct babel_route *
 route_stream_next(struct route_stream *stream)
 {
+    struct route_slot *slot;
+
     if(stream->installed) {
-        while(stream->index < route_slots) {
-            if(routes[stream->index]->installed)
-                break;
-            else
-                stream->index++;
-        }
-        if(stream->index < route_slots)
-            return routes[stream->index++];
-        else
+        slot = next_route_slot(stream->started ? stream->key : NULL, 1);
+        while(slot && !slot->routes->installed)
+            slot = next_route_slot(slot->key, 1);
+        if(slot == NULL)
             return NULL;
+        memcpy(stream->key, slot->key, ROUTE_KEY_LEN);
+        stream->started = 1;
+        stream->slot = slot;
+        return slot->routes;
     } else {
         struct babel_route *next;
         if(!stream->next) {
-            stream->index++;
-            if(stream->index >= route_slots)
+            slot = next_route_slot(stream->started ? stream->key : NULL, 1);
+            if(slot == NULL)
                 return NULL;
-            stream->next = routes[stream->index];
+            memcpy(stream->key, slot->key, ROUTE_KEY_LEN);
+            stream->started = 1;
+            stream->slot = slot;
+            stream->next = slot->routes;
         }
         next = stream->next;
         stream->next = next->next;
@@ -401,6 +591,34 @@ route_stream_next(struct route_stream *stream)
     }
 }
 
+/* Whether the stream has finished with a slot, in which case it remains
+   valid while the table changes. */
+int
+route_stream_between_slots(struct route_stream *stream)
+{
+    return stream->next == NULL;
+}
+
+/* Whether route has already been returned, or would have been had it
+   existed at the time.  Only meaningful between slots. */
+int
+route_stream_passed(struct route_stream *stream, struct babel_route *route)
+{
+    unsigned char key[ROUTE_KEY_LEN];
+
+    if(!stream->started)
+        return 0;
+    route_src_key(key, route->src);
+    return memcmp(key, stream->key, ROUTE_KEY_LEN) <= 0;
+}
+
+/* The slot of the last route returned, valid until the table changes. */
+struct route_slot *
+route_stream_slot(struct route_stream *stream)
+{
+    return stream->slot;
+}
+
 void
 route_stream_done(struct route_stream *stream)
 {
@@ -423,18 +641,18 @@ metric_to_kernel(int metric)
 /* This is used to maintain the invariant that the installed route is at
    the head of the list. */
 static void
-move_installed_route(struct babel_route *route, int i)
+move_installed_route(struct babel_route *route, struct route_slot *slot)
 {
-    assert(i >= 0 && i < route_slots);
+    assert(slot != NULL);
     assert(route->installed);
 
-    if(route != routes[i]) {
-        struct babel_route *r = routes[i];
+    if(route != slot->routes) {
+        struct babel_route *r = slot->routes;
         while(r->next != route)
             r = r->next;
         r->next = route->next;
-        route->next = routes[i];
-        routes[i] = route;
+        route->next = slot->routes;
+        slot->routes = route;
     }
 }
 
@@ -465,7 +683,8 @@ change_route(int operation, const struct babel_route *route, int metric,
 void
 install_route(struct babel_route *route)
 {
-    int i, rc;
+    struct route_slot *slot;
+    int rc;
 
     if(route->installed)
         return;
@@ -474,11 +693,11 @@ install_route(struct babel_route *route)
         fprintf(stderr, "WARNING: installing unfeasible route "
                 "(this shouldn't happen).");
 
-    i = find_route_slot(route->src->prefix, route->src->plen,
-                        route->src->src_prefix, route->src->src_plen, NULL);
-    assert(i >= 0 && i < route_slots);
+    slot = find_route_slot(route->src->prefix, route->src->plen,
+                           route->src->src_prefix, route->src->src_plen);
+    assert(slot != NULL);
 
-    if(routes[i] != route && routes[i]->installed) {
+    if(slot->routes != route && slot->routes->installed) {
         fprintf(stderr, "WARNING: attempting to install duplicate route "
                 "(this shouldn't happen).");
         return;
@@ -495,7 +714,7 @@ install_route(struct babel_route *route)
     }
 
     route->installed = 1;
-    move_installed_route(route, i);
+    move_installed_route(route, slot);
 
     local_notify_route(route, LOCAL_CHANGE);
 }
@@ -523,6 +742,29 @@ uninstall_route(struct babel_route *route)
     local_notify_route(route, LOCAL_CHANGE);
 }
 
+/* Route operations may be carried out by the kernel after kernel_route
+   has returned.  If an addition fails, the route is no longer
+   installed.  This must not call back into kernel_route. */
+void
+kernel_route_failed(int operation, const struct kernel_route *kroute,
+                    int error)
+{
+    struct babel_route *route;
+
+    if(operation != ROUTE_ADD)
+        return;
+
+    route = find_installed_route(kroute->prefix, kroute->plen,
+                                 kroute->src_prefix, kroute->src_plen);
+    if(route == NULL ||
+       route->neigh->ifp->ifindex != kroute->ifindex ||
+       memcmp(route->nexthop, kroute->gw, 16) != 0)
+        return;
+
+    route->installed = 0;
+    local_notify_route(route, LOCAL_CHANGE);
+}
+
 /* This is equivalent to uninstall_route followed with install_route,
    but without the race condition.  The destination of both routes
    must be the same. */
@@ -558,8 +800,7 @@ switch_routes(struct babel_route *old, struct babel_route *new)
     new->installed = 1;
     move_installed_route(new, find_route_slot(new->src->prefix, new->src->plen,
                                               new->src->src_prefix,
-                                              new->src->src_plen,
-                                              NULL));
+                                              new->src->src_plen));
     local_notify_route(old, LOCAL_CHANGE);
     local_notify_route(new, LOCAL_CHANGE);
 }
@@ -761,18 +1002,16 @@ route_acceptable(struct babel_route *route, int feasible,
    we use sm <= sm'.  We could probably use a lexical ordering, but
    that's probably overkill. */
 
-struct babel_route *
-find_best_route(const unsigned char *prefix, unsigned char plen,
-                const unsigned char *src_prefix, unsigned char src_plen,
+static struct babel_route *
+slot_best_route(const struct route_slot *slot,
                 int feasible, struct neighbour *exclude)
 {
     struct babel_route *route, *r;
-    int i = find_route_slot(prefix, plen, src_prefix, src_plen, NULL);
 
-    if(i < 0)
+    if(slot == NULL)
         return NULL;
 
-    route = routes[i];
+    route = slot->routes;
     while(route && !route_acceptable(route, feasible, exclude))
         route = route->next;
 
@@ -790,6 +1029,16 @@ find_best_route(const unsigned char *prefix, unsigned char plen,
     return route;
 }
 
+struct babel_route *
+find_best_route(const unsigned char *prefix, unsigned char plen,
+                const unsigned char *src_prefix, unsigned char src_plen,
+                int feasible, struct neighbour *exclude)
+{
+    return slot_best_route(find_route_slot(prefix, plen,
+                                           src_prefix, src_plen),
+                           feasible, exclude);
+}
+
 void
 update_route_metric(struct babel_route *route)
 {
@@ -826,16 +1075,10 @@ update_neighbour_metric(struct neighbour *neigh, int changed)
 {
 
     if(changed) {
-        int i;
-
-        for(i = 0; i < route_slots; i++) {
-            struct babel_route *r = routes[i];
-            while(r) {
-                if(r->neigh == neigh)
-                    update_route_metric(r);
-                r = r->next;
-            }
-        }
+        struct babel_route *r;
+
+        for(r = neigh->routes; r; r = r->neigh_next)
+            update_route_metric(r);
     }
 
     local_notify_neighbour(neigh, LOCAL_CHANGE);
@@ -843,16 +1086,91 @@ update_neighbour_metric(struct neighbour *neigh, int changed)
 
 void
 update_interface_metric(struct interface *ifp)
+{
+    struct neighbour *neigh;
+
+    FOR_INTERFACE_NEIGHBOURS(neigh, ifp) {
+        struct babel_route *r;
+        for(r = neigh->routes; r; r = r->neigh_next)
+            update_route_metric(r);
+    }
+}
+
+/* Records the state of slot before route is changed by an update.
+   Returns -1 if selection cannot be deferred, in which case the caller
+   must do it right away. */
+static int
+mark_slot_dirty(struct route_slot *slot, const struct babel_route *route)
+{
+    if(slot->dirty == 0) {
+        struct babel_route *installed = route_slot_installed(slot);
+        struct dirty_slot *d;
+
+        if(num_dirty_slots >= max_dirty_slots) {
+            int n = max_dirty_slots == 0 ? 64 : 2 * max_dirty_slots;
+            d = realloc(dirty_slots, n * sizeof(struct dirty_slot));
+            if(d == NULL) {
+                perror("realloc(dirty_slots)");
+                return -1;
+            }
+            dirty_slots = d;
+            max_dirty_slots = n;
+        }
+
+        d = &dirty_slots[num_dirty_slots++];
+        d->slot = slot;
+        d->oldsrc = installed ? retain_source(installed->src) : NULL;
+        d->oldmetric = installed ? route_metric(installed) : INFINITY;
+        d->changed = 0;
+        slot->dirty = num_dirty_slots;
+    }
+
+    if(route->installed)
+        dirty_slots[slot->dirty - 1].changed = 1;
+    return 0;
+}
+
+/* Runs route selection once for every destination touched by
+   update_route or retract_neighbour_routes since the last call.  This
+   must be called after every batch of received packets. */
+void
+select_dirty_routes(void)
 {
     int i;
 
-    for(i = 0; i < route_slots; i++) {
-        struct babel_route *r = routes[i];
-        while(r) {
-            if(r->neigh->ifp == ifp)
-                update_route_metric(r);
-            r = r->next;
+    for(i = 0; i < num_dirty_slots; i++) {
+        struct route_slot *slot = dirty_slots[i].slot;
+        struct source *oldsrc = dirty_slots[i].oldsrc;
+        unsigned short oldmetric = dirty_slots[i].oldmetric;
+        struct babel_route *installed, *best;
+
+        if(slot == NULL)
+            goto done;
+        slot->dirty = 0;
+
+        installed = route_slot_installed(slot);
+        best = slot_best_route(slot, 1, NULL);
+        if(installed) {
+            if(best && best != installed)
+                consider_route(best);
+            if(installed->installed && dirty_slots[i].changed)
+                send_triggered_update(installed, oldsrc, oldmetric);
+        } else if(oldsrc) {
+            route_lost(oldsrc, oldmetric);
+        } else if(best) {
+            consider_route(best);
         }
+
+    done:
+        if(oldsrc)
+            release_source(oldsrc);
+    }
+    num_dirty_slots = 0;
+
+    if(max_dirty_slots > 1024) {
+        free(dirty_slots);
+        dirty_slots = NULL;
+        max_dirty_slots = 0;
     }
 }
 
@@ -866,9 +1184,10 @@ update_route(const unsigned char *id,
              struct neighbour *neigh, const unsigned char *nexthop,
              const unsigned char *channels, int channels_len)
 {
+    struct route_slot *slot;
     struct babel_route *route;
     struct source *src;
-    int metric, feasible;
+    int metric, feasible, deferred;
     int add_metric;
     int hold_time = MAX((4 * interval) / 100 + interval / 50, 15);
     int is_v4;
@@ -899,7 +1218,8 @@ update_route(const unsigned char *id,
     if(add_metric >= INFINITY)
         return NULL;
 
-    route = find_route(prefix, plen, src_prefix, src_plen, neigh);
+    slot = find_route_slot(prefix, plen, src_prefix, src_plen);
+    route = slot_route(slot, neigh);
 
     if(refmetric >= INFINITY && !route) {
         /* Somebody's retracting a route that we've never seen. */
@@ -934,6 +1254,7 @@ update_route(const unsigned char *id,
         oldinstalled = route->installed;
         oldsrc = route->src;
         oldmetric = route_metric(route);
+        deferred = mark_slot_dirty(slot, route) >= 0;
 
         /* If a successor switches sources, we must accept their update even
            if it makes a route unfeasible in order to break any routing loops
@@ -981,14 +1302,17 @@ update_route(const unsigned char *id,
                             refmetric, neighbour_cost(neigh), add_metric);
         route->hold_time = hold_time;
 
-        route_changed(route, oldsrc, oldmetric);
-        if(!lost) {
-            lost = oldinstalled &&
-                find_installed_route(prefix, plen, src_prefix, src_plen) == NULL;
+        if(!deferred) {
+            route_changed(route, oldsrc, oldmetric);
+            if(!lost) {
+                lost = oldinstalled &&
+                    find_installed_route(prefix, plen,
+                                         src_prefix, src_plen) == NULL;
+            }
+            if(lost)
+                route_lost(oldsrc, oldmetric);
         }
-        if(lost)
-            route_lost(oldsrc, oldmetric);
-        else if(!feasible)
+        if(!lost && !feasible)
             send_unfeasible_request(neigh, route_old(route), seqno, metric, src);
         release_source(oldsrc);
     } else {
@@ -1040,7 +1364,10 @@ update_route(const unsigned char *id,
             return NULL;
         }
         local_notify_route(route, LOCAL_ADD);
-        consider_route(route);
+        if(slot == NULL)
+            slot = find_route_slot(prefix, plen, src_prefix, src_plen);
+        if(mark_slot_dirty(slot, route) < 0)
+            consider_route(route);
     }
     return route;
 }
@@ -1125,20 +1452,21 @@ consider_route(struct babel_route *route)
 void
 retract_neighbour_routes(struct neighbour *neigh)
 {
-    int i;
+    struct babel_route *r;
 
-    for(i = 0; i < route_slots; i++) {
-        struct babel_route *r = routes[i];
-        while(r) {
-            if(r->neigh == neigh) {
-                if(r->refmetric != INFINITY) {
-                    unsigned short oldmetric = route_metric(r);
-                    retract_route(r);
-                    if(oldmetric != INFINITY)
-                        route_changed(r, r->src, oldmetric);
-                }
-            }
-            r = r->next;
+    for(r = neigh->routes; r; r = r->neigh_next) {
+        if(r->refmetric != INFINITY) {
+            unsigned short oldmetric = route_metric(r);
+            int deferred = 0;
+            if(oldmetric != INFINITY)
+                deferred = mark_slot_dirty(find_route_slot(r->src->prefix,
+                                                           r->src->plen,
+                                                           r->src->src_prefix,
+                                                           r->src->src_plen),
+                                           r) >= 0;
+            retract_route(r);
+            if(oldmetric != INFINITY && !deferred)
+                route_changed(r, r->src, oldmetric);
         }
     }
 }
@@ -1255,18 +1583,21 @@ route_lost(struct source *src, unsigned oldmetric)
 void
 expire_routes(void)
 {
+    unsigned char key[ROUTE_KEY_LEN];
+    struct route_slot *slot;
     struct babel_route *r;
-    int i;
 
     debugf("Expiring old routes.\n");
 
-    i = 0;
-    while(i < route_slots) {
-        r = routes[i];
+    slot = next_route_slot(NULL, 0);
+    while(slot) {
+        r = slot->routes;
         while(r) {
             /* Protect against clock being stepped. */
             if(r->time > now.tv_sec || route_old(r)) {
+                memcpy(key, slot->key, ROUTE_KEY_LEN);
                 flush_route(r);
+                slot = next_route_slot(key, 0);
                 goto again;
             }
 
@@ -1281,7 +1612,7 @@ expire_routes(void)
             }
             r = r->next;
         }
-        i++;
+        slot = next_route_slot(slot->key, 1);
     again:
         ;
     }
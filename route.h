@@ -41,12 +41,15 @@ struct babel_route {
     short channels_len;
     unsigned char *channels;
     struct babel_route *next;
+    /* List of the routes through the same neighbour. */
+    struct babel_route *neigh_next, *neigh_prev;
 };
 
 struct route_stream;
+struct route_slot;
 
-extern struct babel_route **routes;
 extern int kernel_metric, allow_duplicates, reflect_kernel_metric;
+extern unsigned int route_slot_generation;
 extern int diversity_kind, diversity_factor;
 
 static inline int
@@ -73,6 +76,10 @@ struct babel_route *find_route(const unsigned char *prefix, unsigned char plen,
 struct babel_route *find_installed_route(const unsigned char *prefix,
                         unsigned char plen, const unsigned char *src_prefix,
                         unsigned char src_plen);
+struct route_slot *find_route_slot(const unsigned char *prefix,
+                        unsigned char plen, const unsigned char *src_prefix,
+                        unsigned char src_plen);
+struct babel_route *route_slot_installed(const struct route_slot *slot);
 int installed_routes_estimate(void);
 void flush_route(struct babel_route *route);
 void flush_all_routes(void);
@@ -80,6 +87,9 @@ void flush_neighbour_routes(struct neighbour *neigh);
 void flush_interface_routes(struct interface *ifp, int v4only);
 struct route_stream *route_stream(int which);
 struct babel_route *route_stream_next(struct route_stream *stream);
+struct route_slot *route_stream_slot(struct route_stream *stream);
+int route_stream_between_slots(struct route_stream *stream);
+int route_stream_passed(struct route_stream *stream, struct babel_route *route);
 void route_stream_done(struct route_stream *stream);
 void install_route(struct babel_route *route);
 void uninstall_route(struct babel_route *route);
@@ -113,6 +123,7 @@ void retract_neighbour_routes(struct neighbour *neigh);
 void send_unfeasible_request(struct neighbour *neigh, int force,
                              unsigned short seqno, unsigned short metric,
                              struct source *src);
+void select_dirty_routes(void);
 void consider_route(struct babel_route *route);
 void send_triggered_update(struct babel_route *route,
                            struct source *oldsrc, unsigned oldmetric);
@@ -30,6 +30,7 @@ THE SOFTWARE.
 
 #include "babeld.h"
 #include "util.h"
+#include "timer.h"
 #include "source.h"
 #include "interface.h"
 #include "route.h"
@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2026 by the babeld contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "babeld.h"
+#include "util.h"
+#include "timer.h"
+
+/* The heap is 1-based: the children of slot i are 2i and 2i + 1. */
+static struct timer **heap = NULL;
+static int num_timers = 0, max_timers = 0;
+
+static void
+heap_put(struct timer *timer, int i)
+{
+    heap[i] = timer;
+    timer->index = i;
+}
+
+static void
+sift_up(int i)
+{
+    struct timer *timer = heap[i];
+
+    while(i > 1 && timeval_compare(&heap[i / 2]->time, &timer->time) > 0) {
+        heap_put(heap[i / 2], i);
+        i /= 2;
+    }
+    heap_put(timer, i);
+}
+
+static void
+sift_down(int i)
+{
+    struct timer *timer = heap[i];
+
+    while(2 * i <= num_timers) {
+        int j = 2 * i;
+        if(j < num_timers &&
+           timeval_compare(&heap[j + 1]->time, &heap[j]->time) < 0)
+            j++;
+        if(timeval_compare(&heap[j]->time, &timer->time) >= 0)
+            break;
+        heap_put(heap[j], i);
+        i = j;
+    }
+    heap_put(timer, i);
+}
+
+void
+timer_init(struct timer *timer,
+           void (*handler)(void *closure), void *closure)
+{
+    memset(timer, 0, sizeof(struct timer));
+    timer->handler = handler;
+    timer->closure = closure;
+}
+
+void
+timer_set(struct timer *timer, const struct timeval *time)
+{
+    int i;
+
+    if(!timer_armed(timer)) {
+        if(num_timers + 1 >= max_timers) {
+            int n = max_timers < 16 ? 16 : 2 * max_timers;
+            struct timer **new_heap = realloc(heap, n * sizeof(struct timer*));
+            if(new_heap == NULL) {
+                perror("realloc(timers)");
+                return;
+            }
+            heap = new_heap;
+            max_timers = n;
+        }
+        num_timers++;
+        heap_put(timer, num_timers);
+    }
+
+    timer->time = *time;
+    i = timer->index;
+    sift_up(i);
+    if(timer->index == i)
+        sift_down(i);
+}
+
+void
+timer_cancel(struct timer *timer)
+{
+    int i = timer->index;
+
+    if(!timer_armed(timer))
+        return;
+
+    timer->index = 0;
+    timer->time.tv_sec = 0;
+    timer->time.tv_usec = 0;
+
+    if(i < num_timers) {
+        struct timer *last = heap[num_timers];
+        heap_put(last, i);
+        num_timers--;
+        sift_up(i);
+        if(last->index == i)
+            sift_down(i);
+    } else {
+        num_timers--;
+    }
+}
+
+/* Lowers tv to the expiry time of the next timer, if any. */
+void
+timer_min(struct timeval *tv)
+{
+    if(num_timers > 0)
+        timeval_min(tv, &heap[1]->time);
+}
+
+/* Runs the handlers of all expired timers.  A timer is disarmed before
+   its handler is called, so the handler may re-arm it. */
+void
+run_timers(void)
+{
+    while(num_timers > 0 && timeval_compare(&heap[1]->time, &now) <= 0) {
+        struct timer *timer = heap[1];
+        timer_cancel(timer);
+        timer->handler(timer->closure);
+    }
+}
@@ -0,0 +1,44 @@
+/*
+Copyright (c) 2026 by the babeld contributors
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* A timer is embedded in the structure that owns it, and is linked into
+   a binary heap ordered by expiry time while it is armed. */
+
+struct timer {
+    struct timeval time;
+    int index;                  /* 1-based position in the heap, or 0 */
+    void (*handler)(void *closure);
+    void *closure;
+};
+
+static inline int
+timer_armed(const struct timer *timer)
+{
+    return timer->index > 0;
+}
+
+void timer_init(struct timer *timer,
+                void (*handler)(void *closure), void *closure);
+void timer_set(struct timer *timer, const struct timeval *time);
+void timer_cancel(struct timer *timer);
+void timer_min(struct timeval *tv);
+void run_timers(void);
@@ -515,3 +515,18 @@ prefix_cmp(const unsigned char *p1, unsigned char plen1,
     else
         return PST_EQUALS;
 }
+
+/* FNV-1a.  Start with hash = HASH_INIT, and chain calls to hash
+   several fields. */
+unsigned int
+hash_bytes(unsigned int hash, const void *data, int len)
+{
+    const unsigned char *p = data;
+    int i;
+
+    for(i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
@@ -120,6 +120,10 @@ enum prefix_status {
 enum prefix_status
 prefix_cmp(const unsigned char *p1, unsigned char plen1,
            const unsigned char *p2, unsigned char plen2);
+/* The FNV-1a offset basis, which hash_bytes chains start from. */
+#define HASH_INIT 2166136261U
+unsigned int hash_bytes(unsigned int hash, const void *data, int len)
+    ATTRIBUTE ((pure));
 
 /* If debugging is disabled, we want to avoid calling format_address
    for every omitted debugging message.  So debug is a macro.  But
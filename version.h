@@ -0,0 +1 @@
+#define BABELD_VERSION "unknown"
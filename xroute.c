@@ -30,6 +30,7 @@ THE SOFTWARE.
 
 #include "babeld.h"
 #include "kernel.h"
+#include "timer.h"
 #include "interface.h"
 #include "neighbour.h"
 #include "message.h"
@@ -42,6 +43,17 @@ THE SOFTWARE.
 
 static struct xroute *xroutes;
 static int numxroutes = 0, maxxroutes = 0;
+/* Bumped whenever xroutes are added or removed, since this moves them
+   in memory. */
+unsigned int xroute_generation = 1;
+
+static void
+bump_xroute_generation(void)
+{
+    xroute_generation++;
+    if(xroute_generation == 0)
+        xroute_generation = 1;
+}
 
 static int
 xroute_compare(const unsigned char *prefix, unsigned char plen,
@@ -126,6 +138,8 @@ add_xroute(unsigned char prefix[16], unsigned char plen,
     if(i >= 0)
         return -1;
 
+    bump_xroute_generation();
+
     if(numxroutes >= maxxroutes) {
         struct xroute *new_xroutes;
         int num = maxxroutes < 1 ? 8 : 2 * maxxroutes;
@@ -161,6 +175,7 @@ flush_xroute(struct xroute *xroute)
     assert(i >= 0 && i < numxroutes);
 
     local_notify_xroute(xroute, LOCAL_FLUSH);
+    bump_xroute_generation();
 
     if(i != numxroutes - 1)
         memmove(xroutes + i, xroutes + i + 1,
@@ -221,38 +236,98 @@ xroute_stream_done(struct xroute_stream *stream)
     free(stream);
 }
 
+/* Kernel routes collected by check_xroutes.  The buffer is kept across
+   calls, and only holds routes that pass the redistribution filter. */
+static struct kernel_route *kroutes;
+static int numkroutes = 0, maxkroutes = 0;
+
+static struct kernel_route *
+kroute_slot(void)
+{
+    if(numkroutes >= maxkroutes) {
+        struct kernel_route *new_kroutes;
+        int n = maxkroutes < 1 ? 64 : 2 * maxkroutes;
+        new_kroutes = realloc(kroutes, n * sizeof(struct kernel_route));
+        if(new_kroutes == NULL)
+            return NULL;
+        kroutes = new_kroutes;
+        maxkroutes = n;
+    }
+    return &kroutes[numkroutes];
+}
+
+/* Run the redistribution filter on the route in the next free slot,
+   and keep it if it is accepted. */
+static void
+kroute_keep(struct kernel_route *route)
+{
+    struct filter_result filter_result;
+
+    route->metric = redistribute_filter(route->prefix, route->plen,
+                                        route->src_prefix, route->src_plen,
+                                        route->ifindex, route->proto,
+                                        &filter_result);
+    if(route->metric >= INFINITY)
+        return;
+    if(filter_result.src_prefix != NULL) {
+        memcpy(route->src_prefix, filter_result.src_prefix, 16);
+        route->src_plen = filter_result.src_plen;
+    }
+    numkroutes++;
+}
+
 static int
 filter_route(struct kernel_route *route, void *data) {
-    void **args = (void**)data;
-    int maxroutes = *(int*)args[0];
-    struct kernel_route *routes = (struct kernel_route *)args[1];
-    int *found = (int*)args[2];
-
-    if(*found >= maxroutes)
-        return -1;
+    struct kernel_route *slot;
+    int *failed = (int*)data;
 
     if(martian_prefix(route->prefix, route->plen) ||
        martian_prefix(route->src_prefix, route->src_plen))
         return 0;
 
-    routes[*found] = *route;
-    ++ *found;
+    slot = kroute_slot();
+    if(slot == NULL) {
+        *failed = 1;
+        return -1;
+    }
 
+    *slot = *route;
+    kroute_keep(slot);
     return 0;
 }
 
-static int
-kernel_routes(struct kernel_route *routes, int maxroutes)
+static void
+address_route(const struct kernel_addr *addr, struct kernel_route *route)
 {
-    int found = 0;
-    void *data[3] = { &maxroutes, routes, &found };
-    struct kernel_filter filter = {0};
-    filter.route = filter_route;
-    filter.route_closure = data;
+    memset(route, 0, sizeof(struct kernel_route));
+    memcpy(route->prefix, addr->addr.s6_addr, 16);
+    route->plen = 128;
+    if(v4mapped(route->prefix)) {
+        memcpy(route->src_prefix, v4prefix, 16);
+        route->src_plen = 96;
+    }
+    route->metric = 0;
+    route->ifindex = addr->ifindex;
+    route->proto = RTPROT_BABEL_LOCAL;
+}
 
-    kernel_dump(CHANGE_ROUTE, &filter);
+static int
+filter_xroute_address(struct kernel_addr *addr, void *data) {
+    struct kernel_route *slot;
+    int *failed = (int*)data;
 
-    return found;
+    if(IN6_IS_ADDR_LINKLOCAL(&addr->addr))
+        return 0;
+
+    slot = kroute_slot();
+    if(slot == NULL) {
+        *failed = 1;
+        return -1;
+    }
+
+    address_route(addr, slot);
+    kroute_keep(slot);
+    return 0;
 }
 
 static int
@@ -263,7 +338,7 @@ filter_address(struct kernel_addr *addr, void *data) {
     int *found = (int *)args[2];
     int ifindex = *(int*)args[3];
     int ll = args[4] ? !!*(int*)args[4] : 0;
-    struct kernel_route *route = NULL;
+    struct kernel_route *route;
 
     if(*found >= maxroutes)
         return 0;
@@ -276,17 +351,7 @@ filter_address(struct kernel_addr *addr, void *data) {
         return 0;
 
     route = &routes[*found];
-    memset(route, 0, sizeof(struct kernel_route));
-    memcpy(route->prefix, addr->addr.s6_addr, 16);
-    route->plen = 128;
-    if(v4mapped(route->prefix)) {
-        memcpy(route->src_prefix, v4prefix, 16);
-        route->src_plen = 96;
-    }
-    route->metric = 0;
-    route->ifindex = addr->ifindex;
-    route->proto = RTPROT_BABEL_LOCAL;
-    memset(route->gw, 0, 16);
+    address_route(addr, route);
     ++ *found;
 
     return 1;
@@ -341,63 +406,43 @@ kernel_route_compare(const void *v1, const void *v2)
 int
 check_xroutes(int send_updates)
 {
-    int i, j, change = 0, rc;
+    int i, j, change = 0, rc, failed = 0;
     struct kernel_route *routes;
-    struct filter_result filter_result;
+    struct kernel_filter filter = {0};
     int numroutes;
-    static int maxroutes = 8;
-    const int maxmaxroutes = 256 * 1024;
 
     debugf("\nChecking kernel routes.\n");
 
- again:
-    routes = calloc(maxroutes, sizeof(struct kernel_route));
-    if(routes == NULL)
-        return -1;
+    numkroutes = 0;
 
-    rc = kernel_addresses(0, 0, routes, maxroutes);
-    if(rc < 0) {
+    filter.addr = filter_xroute_address;
+    filter.addr_closure = &failed;
+    rc = kernel_dump(CHANGE_ADDR, &filter);
+    if(rc < 0 && !failed)
         perror("kernel_addresses");
-        numroutes = 0;
-    } else {
-        numroutes = rc;
-    }
 
-    if(numroutes >= maxroutes)
-        goto resize;
+    if(!failed) {
+        memset(&filter, 0, sizeof(filter));
+        filter.route = filter_route;
+        filter.route_closure = &failed;
+        rc = kernel_dump(CHANGE_ROUTE, &filter);
+        if(rc < 0 && !failed)
+            fprintf(stderr, "Couldn't get kernel routes.\n");
+    }
 
-    rc = kernel_routes(routes + numroutes, maxroutes - numroutes);
-    if(rc < 0)
-        fprintf(stderr, "Couldn't get kernel routes.\n");
-    else
-        numroutes += rc;
-
-    if(numroutes >= maxroutes)
-        goto resize;
-
-    for(i = 0; i < numroutes; i++) {
-        routes[i].metric = redistribute_filter(routes[i].prefix, routes[i].plen,
-                                               routes[i].src_prefix,
-                                               routes[i].src_plen,
-                                               routes[i].ifindex,
-                                               routes[i].proto,
-                                               &filter_result);
-        if(filter_result.src_prefix != NULL) {
-            memcpy(routes[i].src_prefix, filter_result.src_prefix, 16);
-            routes[i].src_plen = filter_result.src_plen;
-        }
+    /* Don't flush xroutes based on a partial view of the kernel. */
+    if(failed) {
+        fprintf(stderr, "Couldn't allocate kernel routes.\n");
+        return -1;
     }
 
+    routes = kroutes;
+    numroutes = numkroutes;
+
     qsort(routes, numroutes, sizeof(struct kernel_route), kernel_route_compare);
     i = 0;
     j = 0;
     while(i < numroutes || j < numxroutes) {
-        /* Ignore routes filtered out. */
-        if(i < numroutes && routes[i].metric >= INFINITY) {
-            i++;
-            continue;
-        }
-
         if(i >= numroutes)
             rc = +1;
         else if(j >= numxroutes)
@@ -437,10 +482,10 @@ check_xroutes(int send_updates)
             unsigned char prefix[16], plen;
             unsigned char src_prefix[16], src_plen;
             struct babel_route *route;
-            memcpy(prefix, xroutes[i].prefix, 16);
-            plen = xroutes[i].plen;
-            memcpy(src_prefix, xroutes[i].src_prefix, 16);
-            src_plen = xroutes[i].src_plen;
+            memcpy(prefix, xroutes[j].prefix, 16);
+            plen = xroutes[j].plen;
+            memcpy(src_prefix, xroutes[j].src_prefix, 16);
+            src_plen = xroutes[j].src_plen;
             flush_xroute(&xroutes[j]);
             route = find_best_route(prefix, plen, src_prefix, src_plen,
                                     1, NULL);
@@ -465,15 +510,88 @@ check_xroutes(int send_updates)
         }
     }
 
-    free(routes);
-    /* Set up maxroutes for the next call. */
-    maxroutes = MIN(numroutes + 8, maxmaxroutes);
+    /* Give back memory after a large drop in the number of routes. */
+    if(maxkroutes > 64 && numkroutes < maxkroutes / 4) {
+        struct kernel_route *new_kroutes;
+        int n = MAX(maxkroutes / 2, 64);
+        new_kroutes = realloc(kroutes, n * sizeof(struct kernel_route));
+        if(new_kroutes != NULL) {
+            kroutes = new_kroutes;
+            maxkroutes = n;
+        }
+    }
     return change;
+}
+
+/* Apply a single route change notified by the kernel, without dumping
+   the whole table.  Returns 1 if the set of exported routes changed,
+   0 if it didn't, and -1 if the caller should fall back to
+   check_xroutes. */
+int
+apply_kernel_route(struct kernel_route *kroute)
+{
+    struct filter_result filter_result;
+    struct xroute *xroute;
+    struct babel_route *route;
+    int metric, rc;
+
+    if(kroute->change != KERNEL_ROUTE_NEW &&
+       kroute->change != KERNEL_ROUTE_DEL)
+        return -1;
+
+    if(martian_prefix(kroute->prefix, kroute->plen) ||
+       martian_prefix(kroute->src_prefix, kroute->src_plen))
+        return 0;
+
+    metric = redistribute_filter(kroute->prefix, kroute->plen,
+                                 kroute->src_prefix, kroute->src_plen,
+                                 kroute->ifindex, kroute->proto,
+                                 &filter_result);
+    if(filter_result.src_prefix != NULL) {
+        memcpy(kroute->src_prefix, filter_result.src_prefix, 16);
+        kroute->src_plen = filter_result.src_plen;
+    }
+    if(metric >= INFINITY)
+        return 0;
+
+    xroute = find_xroute(kroute->prefix, kroute->plen,
+                         kroute->src_prefix, kroute->src_plen);
 
- resize:
-    free(routes);
-    if(maxroutes >= maxmaxroutes)
+    if(kroute->change == KERNEL_ROUTE_DEL) {
+        /* Another kernel route for the same prefix, with a different
+           gateway or metric, may still be there; only a dump can tell. */
+        if(xroute == NULL || xroute->ifindex != kroute->ifindex ||
+           xroute->proto != kroute->proto)
+            return 0;
         return -1;
-    maxroutes = MIN(maxmaxroutes, 2 * maxroutes);
-    goto again;
+    }
+
+    if(xroute != NULL) {
+        /* check_xroutes decides which of several kernel routes wins. */
+        if(xroute->ifindex != kroute->ifindex)
+            return -1;
+        if(xroute->metric == metric && xroute->proto == kroute->proto)
+            return 0;
+        xroute->metric = metric;
+        xroute->proto = kroute->proto;
+        local_notify_xroute(xroute, LOCAL_CHANGE);
+        send_update(NULL, 0, xroute->prefix, xroute->plen,
+                    xroute->src_prefix, xroute->src_plen);
+        return 1;
+    }
+
+    rc = add_xroute(kroute->prefix, kroute->plen,
+                    kroute->src_prefix, kroute->src_plen,
+                    metric, kroute->ifindex, kroute->proto);
+    if(rc <= 0)
+        return rc;
+    route = find_installed_route(kroute->prefix, kroute->plen,
+                                 kroute->src_prefix, kroute->src_plen);
+    if(route) {
+        if(allow_duplicates < 0 || metric < allow_duplicates)
+            uninstall_route(route);
+    }
+    send_update(NULL, 0, kroute->prefix, kroute->plen,
+                kroute->src_prefix, kroute->src_plen);
+    return 1;
 }
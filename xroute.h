@@ -32,6 +32,8 @@ struct xroute {
 
 struct xroute_stream;
 
+extern unsigned int xroute_generation;
+
 struct xroute *find_xroute(const unsigned char *prefix, unsigned char plen,
                 const unsigned char *src_prefix, unsigned char src_plen);
 int add_xroute(unsigned char prefix[16], unsigned char plen,
@@ -45,3 +47,4 @@ void xroute_stream_done(struct xroute_stream *stream);
 int kernel_addresses(int ifindex, int ll,
                      struct kernel_route *routes, int maxroutes);
 int check_xroutes(int send_updates);
+int apply_kernel_route(struct kernel_route *kroute);